@@ -0,0 +1,48 @@
+/*
+   CPU affinity for the per-core acceptors.
+
+   cpu_set_t and its macros need _GNU_SOURCE, whose netdb.h
+   declarations clash with csapp.h, so this file stands on its own
+   like zcopy.c.
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <unistd.h>
+
+/* number of CPUs this process may run on */
+int usable_cpus()
+{
+    cpu_set_t set;
+    int n;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 &&
+        (n = CPU_COUNT(&set)) > 0) {
+        return n;
+    }
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+/* keep the calling thread on the i-th CPU this process may use,
+ counting round again past the last one. returns -1 if it could not
+ be pinned */
+int pin_to_cpu(int i)
+{
+    cpu_set_t set, one;
+    int cpu, seen = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set) < 0 ||
+        CPU_COUNT(&set) == 0) {
+        return -1;
+    }
+    i %= CPU_COUNT(&set);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set) && seen++ == i) {
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            return sched_setaffinity(0, sizeof(one), &one);
+        }
+    }
+    return -1;
+}
@@ -1,77 +1,354 @@
 #include "cache.h"
 
 /* Global variables */
-static struct cached_elem *cache_list=NULL;
-static size_t cache_size=0;
-static int count =0;
-static sem_t mutex,w;
+static struct cache_shard *shards=NULL;
+static int nshards=0;
+static size_t shard_capacity=0;
+static evict_callback evict_fn=NULL;
+static void *evict_arg=NULL;
+static struct cache_policy *policy=NULL;
+static struct slab cache_slab;     /* memory of every element */
 
-/* initialize cache list */
-void init_cache()
+/* initialize the cache with n shards and the named replacement
+ policy (NULL means lru).
+ every shard must be able to hold the largest object, so n is
+ clamped to [1, MAX_CACHE_SIZE/largest], where largest is what the
+ slab charges for an element holding MAX_OBJECT_SIZE bytes under the
+ longest tag */
+void init_cache(int n, char *policy_name)
 {
-    cache_list =NULL;
-    cache_size =0;
-    count = 0;
-    Sem_init(&mutex, 0, 1);
-    Sem_init(&w, 0 ,1);
+    size_t largest;
+    int i;
+
+    if ((policy = find_policy(policy_name ? policy_name : "lru")) == NULL) {
+        app_error("init_cache: unknown replacement policy");
+    }
+
+    slab_init(&cache_slab);
+    largest = slab_chunk_size(&cache_slab, sizeof(struct cached_elem) +
+                              sizeof(((request_info *)0)->hostname) +
+                              sizeof(((request_info *)0)->uri) +
+                              MAX_OBJECT_SIZE);
+    if (n < 1) {
+        n = 1;
+    }
+    if ((size_t)n > MAX_CACHE_SIZE/largest) {
+        n = MAX_CACHE_SIZE/largest;
+    }
+    nshards = n;
+    shard_capacity = MAX_CACHE_SIZE/nshards;
+    shards = (struct cache_shard *)Calloc(nshards, sizeof(struct cache_shard));
+    for (i=0; i<nshards; i++) {
+        shards[i].cache_size = 0;
+        shards[i].hash_buckets = CACHE_HASH_INIT;
+        shards[i].hash_table = (struct cached_elem **)
+        Calloc(CACHE_HASH_INIT, sizeof(struct cached_elem *));
+        shards[i].elem_count = 0;
+        Sem_init(&shards[i].mutex, 0, 1);
+        policy->init(&shards[i], shard_capacity);
+    }
 }
 
-/* use the new object and tag to create new element
- insert it into the cache list */
-void insert_element(request_info *req_hdr, unsigned char *object,
-                    size_t obj_length)
+/* register a function to be told about every evicted element */
+void set_evict_callback(evict_callback fn, void *arg)
 {
-    /* lock cache list for writing */
-    P(&w);
-    
-    /* formulate new cache element*/
-    struct cached_elem *new_elem=
-    (struct cached_elem *)Malloc(sizeof(struct cached_elem));
-    strcpy(new_elem->tag.hostname, req_hdr->hostname);
-    strcpy(new_elem->tag.uri, req_hdr->uri);
-    new_elem->tag.port=req_hdr->port;
-    new_elem->object =
-    (unsigned char *)Malloc(sizeof(unsigned char)* obj_length);
-    
-    size_t i;
-    for (i=0; i<obj_length; i++) {
-        new_elem->object[i]=object[i];
+    evict_fn = fn;
+    evict_arg = arg;
+}
+
+/* FNV-1a hash of a tag */
+unsigned int hash_tag(request_info *tag)
+{
+    unsigned int h = 2166136261u;
+    const unsigned char *p;
+    int i;
+
+    for (p = (const unsigned char *)tag->hostname; *p; p++) {
+        h = (h ^ *p) * 16777619u;
     }
-    
-    new_elem->used=1;
-    new_elem->obj_length=obj_length;
-    
-    cache_size = cache_size + obj_length;
-    /* if size exceeds limit, evict*/
-    while(cache_size>MAX_CACHE_SIZE){
-        struct cached_elem *cur=cache_list;
-        /* get the tail */
-        while ((cur->next)!=0) {
-            cur = cur->next;
+    for (i = 0; i < (int)sizeof(tag->port); i++) {
+        h = (h ^ ((tag->port >> (8*i)) & 0xff)) * 16777619u;
+    }
+    for (p = (const unsigned char *)tag->uri; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+/* pick the shard owning a hash. buckets use the low bits,
+ so use the high bits here */
+static struct cache_shard *shard_of(unsigned int h)
+{
+    return &shards[(h >> 16) % nshards];
+}
+
+/* double the number of buckets and rehash every element,
+ so chains stay short however many objects are cached */
+static void hash_grow(struct cache_shard *sh)
+{
+    size_t new_buckets = sh->hash_buckets*2;
+    struct cached_elem **new_table = (struct cached_elem **)
+    Calloc(new_buckets, sizeof(struct cached_elem *));
+    size_t i;
+
+    for (i=0; i<sh->hash_buckets; i++) {
+        struct cached_elem *cur = sh->hash_table[i];
+        while (cur) {
+            struct cached_elem *next = cur->hnext;
+            size_t b = cur->hash & (new_buckets-1);
+            cur->hnext = new_table[b];
+            new_table[b] = cur;
+            cur = next;
         }
-        /* remove the tail */
-        if(cur->prev){
-            cur->prev->next=cur->next;
+    }
+    Free(sh->hash_table);
+    sh->hash_table = new_table;
+    sh->hash_buckets = new_buckets;
+}
+
+/* add element to the hash index */
+static void hash_insert(struct cache_shard *sh, struct cached_elem *elem)
+{
+    size_t b;
+
+    if (sh->elem_count+1 > sh->hash_buckets) {
+        hash_grow(sh);
+    }
+    b = elem->hash & (sh->hash_buckets-1);
+    elem->hnext = sh->hash_table[b];
+    sh->hash_table[b] = elem;
+    sh->elem_count++;
+}
+
+/* remove element from the hash index */
+static void hash_remove(struct cache_shard *sh, struct cached_elem *elem)
+{
+    struct cached_elem **pp =
+    &sh->hash_table[elem->hash & (sh->hash_buckets-1)];
+
+    while (*pp) {
+        if (*pp == elem) {
+            *pp = elem->hnext;
+            sh->elem_count--;
+            return;
         }
-        if (cur->next) {
-            cur->next->prev=cur->prev;
+        pp = &((*pp)->hnext);
+    }
+}
+
+/* look up the element with a given tag in the hash index */
+static struct cached_elem *hash_find(struct cache_shard *sh,
+                                     request_info *req_hdr, unsigned int h)
+{
+    struct cached_elem *cur = sh->hash_table[h & (sh->hash_buckets-1)];
+
+    while (cur) {
+        if (cur->hash == h && cur->port == req_hdr->port &&
+            !strcmp(cur->hostname, req_hdr->hostname) &&
+            !strcmp(cur->uri, req_hdr->uri)) {
+            return cur;
         }
-        cache_size= cache_size - (cur->obj_length);
-        Free(cur);
+        cur = cur->hnext;
+    }
+    return NULL;
+}
+
+/* unlink element from its segment */
+void seg_remove(struct cache_shard *sh, struct cached_elem *elem)
+{
+    struct lru_seg *sg = &sh->seg[(int)elem->seg];
+
+    if (elem->prev) {
+        elem->prev->next = elem->next;
+    }
+    else {
+        sg->head = elem->next;
     }
-    
-    new_elem->prev=NULL;
-    new_elem->next =cache_list;
-    if (cache_list) {
-        cache_list->prev =new_elem;
+    if (elem->next) {
+        elem->next->prev = elem->prev;
     }
-    cache_list=new_elem;
-    
-    
-    /*unlock cache list*/
-    V(&w);
-    
-    
+    else {
+        sg->tail = elem->prev;
+    }
+    sg->bytes -= elem->charge;
+    elem->prev = NULL;
+    elem->next = NULL;
+}
+
+/* put element at the front (most recently used end) of a segment */
+void seg_push_front(struct cache_shard *sh, int seg,
+                    struct cached_elem *elem)
+{
+    struct lru_seg *sg = &sh->seg[seg];
+
+    elem->seg = seg;
+    elem->prev = NULL;
+    elem->next = sg->head;
+    if (sg->head) {
+        sg->head->prev = elem;
+    }
+    else {
+        sg->tail = elem;
+    }
+    sg->head = elem;
+    sg->bytes += elem->charge;
+}
+
+/* move a linked element to the front of a segment */
+void seg_move_front(struct cache_shard *sh, int seg,
+                    struct cached_elem *elem)
+{
+    if (elem->seg == seg && sh->seg[seg].head == elem) {
+        return;
+    }
+    seg_remove(sh, elem);
+    seg_push_front(sh, seg, elem);
+}
+
+/* drop one reference to an element, freeing it with the last one.
+ caller holds the shard mutex */
+static void elem_put(struct cached_elem *elem)
+{
+    elem->refcnt--;
+    if (elem->refcnt == 0) {
+        slab_free(&cache_slab, elem, elem->size);
+    }
+}
+
+/* take an element out of its shard and drop the cache's reference.
+ readers still holding it keep the memory alive until they release */
+static void unlink_elem(struct cache_shard *sh, struct cached_elem *elem)
+{
+    seg_remove(sh, elem);
+    hash_remove(sh, elem);
+    sh->cache_size = sh->cache_size - elem->charge;
+    elem_put(elem);
+}
+
+/* evict the element the policy picks. if there is an evict callback
+ the victim stays pinned and is chained onto *gone through its next
+ pointer, to be handed to the callback once the shard is unlocked */
+static void evict_one(struct cache_shard *sh, struct cached_elem **gone)
+{
+    struct cached_elem *victim = policy->victim(sh);
+
+    if (evict_fn) {
+        victim->refcnt++;
+    }
+    unlink_elem(sh, victim);
+    if (evict_fn) {
+        victim->next = *gone;
+        *gone = victim;
+    }
+    sh->evictions++;
+}
+
+/* use the new object and tag to create new element
+ insert it into the cache list.
+ meta holds its caching rules, or NULL if it never goes stale */
+void insert_element(request_info *req_hdr, unsigned char *object,
+                    size_t obj_length, int framed, struct cache_meta *meta)
+{
+    size_t hlen = strlen(req_hdr->hostname);
+    size_t ulen = strlen(req_hdr->uri);
+    size_t elem_size = sizeof(struct cached_elem) + hlen + ulen + 2;
+    unsigned int h = hash_tag(req_hdr);
+    struct cache_shard *sh = shard_of(h);
+    size_t charge = slab_chunk_size(&cache_slab, elem_size + obj_length);
+    struct cached_elem *gone = NULL, *victim;
+
+    /* an element that can never fit is not cached */
+    if (charge > shard_capacity) {
+        return;
+    }
+
+    /* formulate new cache element in one slab chunk:
+     the element, its tag, then the object */
+    struct cached_elem *new_elem=
+    (struct cached_elem *)slab_alloc(&cache_slab, elem_size + obj_length);
+    new_elem->hostname = new_elem->key;
+    new_elem->uri = new_elem->key + hlen + 1;
+    memcpy(new_elem->hostname, req_hdr->hostname, hlen + 1);
+    memcpy(new_elem->uri, req_hdr->uri, ulen + 1);
+    new_elem->port=req_hdr->port;
+    new_elem->hash=h;
+    new_elem->object = (unsigned char *)new_elem + elem_size;
+    memcpy(new_elem->object, object, obj_length);
+    new_elem->obj_length=obj_length;
+    new_elem->framed=framed;
+    if (meta) {
+        new_elem->meta = *meta;
+    }
+    else {
+        memset(&new_elem->meta, 0, sizeof(new_elem->meta));
+        new_elem->meta.expires = CACHE_FOREVER;
+    }
+    new_elem->size = elem_size + obj_length;
+    new_elem->charge = charge;
+    new_elem->refcnt = 1;
+
+    /* lock shard */
+    P(&sh->mutex);
+
+    /* a concurrent miss may have cached the same object already */
+    struct cached_elem *old = hash_find(sh, req_hdr, h);
+    if (old) {
+        unlink_elem(sh, old);
+    }
+
+    sh->cache_size = sh->cache_size + new_elem->charge;
+    policy->add(sh, new_elem);
+    hash_insert(sh, new_elem);
+
+    /* if size exceeds limit, evict. the policy may turn away the new
+     element itself, so it must not be touched after this */
+    while (sh->cache_size > shard_capacity) {
+        evict_one(sh, &gone);
+    }
+
+    /*unlock shard*/
+    V(&sh->mutex);
+
+    /* the callback may copy the victims somewhere slow, so it runs
+     without the shard lock */
+    while (gone) {
+        victim = gone;
+        gone = victim->next;
+        evict_fn(victim, evict_arg);
+        release_element(victim);
+    }
+}
+
+
+/* the server said a stale element is still good (a 304 answer
+ carrying meta): make it fresh again. a 304 without a lifetime of
+ its own renews the element for the lifetime it had */
+void refresh_element(struct cached_elem *elem, struct cache_meta *meta)
+{
+    struct cache_shard *sh = shard_of(elem->hash);
+
+    P(&sh->mutex);
+    if (meta->has_lifetime) {
+        elem->meta.lifetime = meta->lifetime;
+        elem->meta.expires = meta->expires;
+    }
+    else {
+        elem->meta.expires = time(NULL) + elem->meta.lifetime;
+    }
+    V(&sh->mutex);
+}
+
+/* when a cached element goes stale. read under the shard lock, as
+ refresh_element may be renewing it meanwhile */
+time_t element_expires(struct cached_elem *elem)
+{
+    struct cache_shard *sh = shard_of(elem->hash);
+    time_t expires;
+
+    P(&sh->mutex);
+    expires = elem->meta.expires;
+    V(&sh->mutex);
+    return expires;
 }
 
 
@@ -89,73 +366,82 @@ int issamehead(request_info *a, request_info *b)
     return 0;
 }
 
-/* find cached object matching request header */
+/* find cached object matching request header.
+ a hit is reported to the replacement policy right away and
+ pinned; the caller must release_element it when done */
 struct cached_elem* fetch_element(request_info *req_hdr)
 {
-    /*lock*/
-    P(&mutex);
-    count++;
-    if (count == 1) {
-        /*first reader lock for writing */
-        P(&w);
-    }
-    
-    /* unlock */
-    V(&mutex);
-    /* find cached element */
-    struct cached_elem *cur= cache_list;
-    while (cur) {
-        if (issamehead(req_hdr, &(cur->tag))) {
-            cur->used =1;
-            break;
-        }
-        cur=cur->next;
-    }
-    
-    /* lock */
-    P(&mutex);
-    count--;
-    if (count==0) {
-        
-        /* update the cache when all readers finish reading */
-        struct cached_elem *cur = cache_list;
-        struct cached_elem *next;
-        while (cur) {
-            if (cur->used) {
-                cur->used =0;
-                /*first element*/
-                if (cur==cache_list) {
-                    cur = cur->next;
-                    continue;
-                }
-                /* remove the element */
-                if(cur->prev){
-                    cur->prev->next=cur->next;
-                }
-                if (cur->next) {
-                    cur->next->prev=cur->prev;
-                }
-                next=cur->next;
-                /* move it to the front */
-                cur->prev =NULL;
-                cur->next = cache_list;
-                if (cache_list) {
-                    cache_list->prev =cur;
-                }
-                cache_list = cur;
-                
-                cur=next;
-            }
-            else{
-                cur=cur->next;
-            }
-        }
-        V(&w);
+    unsigned int h = hash_tag(req_hdr);
+    struct cache_shard *sh = shard_of(h);
+
+    /*lock shard*/
+    P(&sh->mutex);
+
+    /* find cached element through the hash index */
+    struct cached_elem *cur= hash_find(sh, req_hdr, h);
+    if (policy->access) {
+        policy->access(sh, h);
     }
-    /*unlock*/
-    V(&mutex);
+    if (cur) {
+        cur->refcnt++;
+        policy->hit(sh, cur);
+    }
+
+    /*unlock shard*/
+    V(&sh->mutex);
     return cur;
 }
 
+/* unpin an element returned by fetch_element */
+void release_element(struct cached_elem *elem)
+{
+    struct cache_shard *sh = shard_of(elem->hash);
+
+    P(&sh->mutex);
+    elem_put(elem);
+    V(&sh->mutex);
+}
 
+/* add up the memory use of every shard */
+void cache_get_stats(struct cache_stats *st)
+{
+    struct slab_stats ss;
+    int i;
 
+    memset(st, 0, sizeof(*st));
+    st->capacity = shard_capacity*nshards;
+    for (i=0; i<nshards; i++) {
+        P(&shards[i].mutex);
+        st->elems += shards[i].elem_count;
+        st->evictions += shards[i].evictions;
+        V(&shards[i].mutex);
+    }
+    slab_get_stats(&cache_slab, &ss);
+    st->charged = ss.chunks;
+    st->requested = ss.requested;
+    st->mapped = ss.mapped;
+    st->rss = process_rss();
+}
+
+/* drop every cached element and the shards themselves.
+ no element may still be pinned by a reader */
+void free_cache()
+{
+    int i, j;
+
+    for (i=0; i<nshards; i++) {
+        struct cache_shard *sh = &shards[i];
+        P(&sh->mutex);
+        for (j=0; j<CACHE_SEGS; j++) {
+            while (sh->seg[j].head) {
+                unlink_elem(sh, sh->seg[j].head);
+            }
+        }
+        Free(sh->hash_table);
+        V(&sh->mutex);
+    }
+    slab_destroy(&cache_slab);
+    Free(shards);
+    shards = NULL;
+    nshards = 0;
+}
@@ -1,9 +1,23 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <time.h>
 #include "csapp.h"
+#include "slab.h"
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* Initial number of buckets in the cache hash index */
+#define CACHE_HASH_INIT 64
+
+/* LRU segments per shard, and the count-min sketch used by W-TinyLFU */
+#define CACHE_SEGS 3
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 4096       /* counters per row, a power of 2 */
+#define SKETCH_MAX 15           /* counters saturate here */
+
 /* Structrure for request information */
 typedef struct {
     char hostname[MAXLINE];
@@ -11,22 +25,129 @@ typedef struct {
     char uri[MAXLINE];
 }request_info;
 
+/* what a response allows a shared cache to do with it.
+ filled in by parse_cache_meta in httpcache.c */
+struct cache_meta{
+    int storable;
+    int has_lifetime;       /* the response gave its own lifetime */
+    time_t lifetime;        /* seconds it stays fresh */
+    time_t expires;         /* fresh until then */
+    size_t etag_off;        /* validators, as offsets into the object */
+    size_t etag_len;
+    size_t lm_off;
+    size_t lm_len;
+    size_t body_off;        /* length of the header block, 0 if cut short */
+    long length;            /* Content-Length, -1 if not given */
+    int gzip;               /* body is gzipped */
+    int chunked;            /* body is in chunked framing */
+};
+
+/* expiry of elements inserted without caching rules */
+#define CACHE_FOREVER ((time_t)0x7fffffff)
+
 /* data structure for elements in the cache
-   it is doubly linked with pointers prev and next.
+   it is doubly linked with pointers prev and next inside the LRU
+   segment seg of its shard.
+   hnext chains elements that fall into the same hash bucket.
+   the hostname and uri of the tag, then the object itself, are
+   stored right after the element in one chunk of the cache slab.
+   refcnt counts the cache's own reference plus one for every
+   reader that fetched the element and has not released it yet.
  */
 struct cached_elem{
     struct cached_elem *prev;
     struct cached_elem *next;
-    request_info tag;
-    char used;
+    struct cached_elem *hnext;
+    unsigned int hash;
+    char *hostname;
+    char *uri;
+    int port;
     unsigned char *object;
     size_t obj_length;
+    char framed;            /* response says where it ends */
+    struct cache_meta meta; /* freshness and validators */
+    char seg;               /* segment the element is linked into */
+    size_t size;            /* bytes asked of the slab */
+    size_t charge;          /* slab chunk size, charged against the cache */
+    int refcnt;             /* protected by the shard mutex */
+    char key[];
 };
 
+/* a list of elements in recency order.
+ head is the most recently used end, tail the least */
+struct lru_seg{
+    struct cached_elem *head;
+    struct cached_elem *tail;
+    size_t bytes;           /* charge of the elements in the segment */
+    size_t cap;             /* target size, set by the policy */
+};
+
+/* a shard owns its own lock, LRU segments and hash index.
+ requests are spread over shards by the hash of their tag.
+ how the segments are used is up to the replacement policy */
+struct cache_shard{
+    sem_t mutex;
+    struct lru_seg seg[CACHE_SEGS];
+    size_t cache_size;
+    struct cached_elem **hash_table;
+    size_t hash_buckets;
+    size_t elem_count;
+    size_t evictions;
+    unsigned char sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+    size_t sketch_adds;
+};
+
+/* a replacement policy. every hook is called with the shard mutex
+ held. access sees every lookup, hit or miss, and may be NULL.
+ victim picks the element to evict while the shard is over capacity;
+ the cache then unlinks and frees it */
+struct cache_policy{
+    char *name;
+    void (*init)(struct cache_shard *sh, size_t capacity);
+    void (*access)(struct cache_shard *sh, unsigned int hash);
+    void (*hit)(struct cache_shard *sh, struct cached_elem *elem);
+    void (*add)(struct cache_shard *sh, struct cached_elem *elem);
+    struct cached_elem *(*victim)(struct cache_shard *sh);
+};
+
+/* memory use of the whole cache, in bytes */
+struct cache_stats{
+    size_t elems;           /* cached elements */
+    size_t evictions;       /* elements evicted so far */
+    size_t capacity;        /* configured budget */
+    size_t charged;         /* chunk bytes charged against the budget */
+    size_t requested;       /* bytes the elements actually need */
+    size_t mapped;          /* bytes the slab has mapped */
+    size_t rss;             /* resident size of the process */
+};
+
+/* called with every evicted element, without the shard lock held,
+ before the element is freed */
+typedef void (*evict_callback)(struct cached_elem *elem, void *arg);
+
 /* Function prototypes */
-void init_cache();
+void init_cache(int n, char *policy);
+void free_cache();
 struct cached_elem* fetch_element(request_info *req_hdr);
+void release_element(struct cached_elem *elem);
 void insert_element(request_info *req_hdr,
-                    unsigned char *object, size_t obj_length);
-void update();
-int issamehead(request_info *a, request_info *b);
\ No newline at end of file
+                    unsigned char *object, size_t obj_length, int framed,
+                    struct cache_meta *meta);
+void refresh_element(struct cached_elem *elem, struct cache_meta *meta);
+time_t element_expires(struct cached_elem *elem);
+void set_evict_callback(evict_callback fn, void *arg);
+void cache_get_stats(struct cache_stats *st);
+int issamehead(request_info *a, request_info *b);
+unsigned int hash_tag(request_info *tag);
+
+/* Segment helpers shared with the policies in policy.c */
+void seg_remove(struct cache_shard *sh, struct cached_elem *elem);
+void seg_push_front(struct cache_shard *sh, int seg,
+                    struct cached_elem *elem);
+void seg_move_front(struct cache_shard *sh, int seg,
+                    struct cached_elem *elem);
+
+/* Replacement policies in policy.c */
+struct cache_policy *find_policy(char *name);
+
+#endif /* __CACHE_H__ */
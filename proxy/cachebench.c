@@ -0,0 +1,130 @@
+/*
+   cachebench - time lookups in the proxy cache outside the proxy.
+
+   usage: cachebench [-n entries] [-l lookups] [-t threads] [-s shards]
+                     [-p policy]
+
+   inserts entries small objects under distinct keys, then each of
+   threads threads looks up lookups keys picked at random among them.
+   reports the wall time per lookup, the lookups per second of all
+   threads together and the share that hit. keys evicted to keep the
+   cache within MAX_CACHE_SIZE miss, like they would in the proxy.
+
+   build: gcc -O2 -o cachebench cachebench.c cache.c policy.c slab.c csapp.c -lpthread
+ */
+
+#include "cache.h"
+#include <getopt.h>
+
+#define KEY_LEN 24                  /* room for "/obj/<n>" */
+
+static char (*uris)[KEY_LEN];       /* the uri of every key */
+static int entries = 1000;
+static long lookups = 1000000;
+static long total_hits = 0;
+
+/* a monotonic clock in nanoseconds */
+static long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+/* thread routine: look up random keys, counting the hits */
+static void *lookup_keys(void *vargp)
+{
+    unsigned int seed = 12345 + 7919 * (unsigned int)(long)vargp;
+    request_info req;
+    struct cached_elem *elem;
+    long i, hits = 0;
+
+    strcpy(req.hostname, "bench.example.com");
+    req.port = 80;
+    for (i = 0; i < lookups; i++) {
+        /* xorshift, cheap next to the lookup itself */
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        strcpy(req.uri, uris[seed % entries]);
+        if ((elem = fetch_element(&req))) {
+            hits++;
+            release_element(elem);
+        }
+    }
+    __sync_fetch_and_add(&total_hits, hits);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int opt, shards = 1, nthreads = 1, i;
+    char *policy = NULL;
+    unsigned char object[16];
+    request_info req;
+    pthread_t *tids;
+    long start, ns;
+
+    while ((opt = getopt(argc, argv, "n:l:t:s:p:")) != -1) {
+        switch (opt) {
+            case 'n':
+                entries = atoi(optarg);
+                break;
+            case 'l':
+                lookups = atol(optarg);
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 's':
+                shards = atoi(optarg);
+                break;
+            case 'p':
+                policy = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n entries] [-l lookups] "
+                        "[-t threads] [-s shards] [-p policy]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (entries < 1 || lookups < 1 || nthreads < 1) {
+        fprintf(stderr, "entries, lookups and threads must be positive\n");
+        exit(1);
+    }
+    if (policy && !find_policy(policy)) {
+        fprintf(stderr, "unknown policy %s\n", policy);
+        exit(1);
+    }
+
+    init_cache(shards, policy);
+    uris = Malloc((size_t)entries * KEY_LEN);
+    memset(object, 'x', sizeof(object));
+    strcpy(req.hostname, "bench.example.com");
+    req.port = 80;
+    for (i = 0; i < entries; i++) {
+        sprintf(uris[i], "/obj/%d", i);
+        strcpy(req.uri, uris[i]);
+        insert_element(&req, object, sizeof(object), 1, NULL);
+    }
+
+    tids = (pthread_t *)Malloc(nthreads * sizeof(pthread_t));
+    start = now_ns();
+    for (i = 0; i < nthreads; i++) {
+        Pthread_create(&tids[i], NULL, lookup_keys, (void *)(long)i);
+    }
+    for (i = 0; i < nthreads; i++) {
+        Pthread_join(tids[i], NULL);
+    }
+    ns = now_ns() - start;
+
+    printf("entries:%d threads:%d lookups:%ld ns/lookup:%.1f "
+           "lookups/s:%.0f hit ratio:%.4f\n", entries, nthreads,
+           lookups*nthreads, (double)ns/(lookups*nthreads),
+           lookups*nthreads*1e9/ns, (double)total_hits/(lookups*nthreads));
+    free_cache();
+    Free(tids);
+    Free(uris);
+    return 0;
+}
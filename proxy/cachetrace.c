@@ -0,0 +1,112 @@
+/*
+   cachetrace - replay a recorded request log against the proxy cache
+   and report the byte hit ratio of each replacement policy.
+
+   usage: cachetrace [-s shards] [-p policy] <tracefile>
+
+   each line of the trace is one request:
+
+       <hostname> <port> <uri> <size>
+
+   where size is the length of the whole response in bytes. a miss
+   inserts an object of that size, as the proxy would after fetching
+   it; responses over MAX_OBJECT_SIZE are never cached. without -p
+   every policy is replayed in turn. after each replay the memory
+   the cache holds is reported against its budget.
+
+   build: gcc -O2 -o cachetrace cachetrace.c cache.c policy.c slab.c csapp.c -lpthread
+ */
+
+#include "cache.h"
+#include <getopt.h>
+
+static char *policy_names[] = { "lru", "slru", "tinylfu" };
+
+/* replay the trace once with one policy */
+static void replay(FILE *fp, int shards, char *policy, unsigned char *object)
+{
+    char line[3*MAXLINE];
+    request_info req;
+    long size;
+    size_t requests = 0, hits = 0;
+    struct cache_stats st;
+    double bytes = 0, hit_bytes = 0;
+    struct cached_elem *elem;
+
+    init_cache(shards, policy);
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%s %d %s %ld", req.hostname, &req.port,
+                   req.uri, &size) != 4 || size < 0) {
+            continue;
+        }
+        requests++;
+        bytes += size;
+        if ((elem = fetch_element(&req))) {
+            hits++;
+            hit_bytes += size;
+            release_element(elem);
+        }
+        else if (size <= MAX_OBJECT_SIZE) {
+            insert_element(&req, object, size, 1, NULL);
+        }
+    }
+    cache_get_stats(&st);
+    free_cache();
+
+    printf("%-8s requests:%zu hits:%zu hit ratio:%.4f byte hit ratio:%.4f\n",
+           policy, requests, hits,
+           requests ? (double)hits/requests : 0.0,
+           bytes > 0 ? hit_bytes/bytes : 0.0);
+    printf("%-8s objects:%zu budget:%zu charged:%zu mapped:%zu rss:%zu "
+           "internal fragmentation:%.4f\n",
+           "", st.elems, st.capacity, st.charged, st.mapped, st.rss,
+           st.charged ? 1.0 - (double)st.requested/st.charged : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+    int opt, shards = 1;
+    char *policy = NULL;
+    unsigned char *object;
+    FILE *fp;
+    size_t i;
+
+    while ((opt = getopt(argc, argv, "s:p:")) != -1) {
+        switch (opt) {
+            case 's':
+                shards = atoi(optarg);
+                break;
+            case 'p':
+                policy = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-s shards] [-p policy] "
+                        "<tracefile>\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (optind != argc-1) {
+        fprintf(stderr, "usage: %s [-s shards] [-p policy] <tracefile>\n",
+                argv[0]);
+        exit(1);
+    }
+    if (policy && !find_policy(policy)) {
+        fprintf(stderr, "unknown policy %s\n", policy);
+        exit(1);
+    }
+
+    fp = Fopen(argv[optind], "r");
+    object = (unsigned char *)Calloc(MAX_OBJECT_SIZE, 1);
+    if (policy) {
+        replay(fp, shards, policy, object);
+    }
+    else {
+        for (i = 0; i < sizeof(policy_names)/sizeof(policy_names[0]); i++) {
+            replay(fp, shards, policy_names[i], object);
+        }
+    }
+    Free(object);
+    Fclose(fp);
+    return 0;
+}
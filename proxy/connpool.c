@@ -0,0 +1,166 @@
+/*
+   pool of persistent connections to web servers.
+
+   after a response has been read in full on a keep-alive connection,
+   the proxy hands the descriptor back with pool_put instead of closing
+   it. the next miss for the same (host, port) takes it with pool_get
+   and skips both the name lookup and the TCP handshake.
+   connections idle for more than POOL_IDLE_TIMEOUT seconds are closed,
+   and at most POOL_MAX_PER_HOST are kept per server. a reaper thread
+   sweeps the whole table every POOL_SWEEP_INTERVAL seconds, so idle
+   connections to servers never asked for again are closed too, and
+   entries left with none are freed.
+ */
+
+#include "connpool.h"
+
+/* Global variables */
+static struct pool_host *pool_table[POOL_BUCKETS];
+static sem_t pool_mutex;
+
+
+/* hash of a (host, port) pair */
+static unsigned int pool_hash(char *hostname, int port)
+{
+    unsigned int h = 2166136261u;
+    const unsigned char *p;
+
+    for (p = (const unsigned char *)hostname; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    h = (h ^ (unsigned int)port) * 16777619u;
+    return h % POOL_BUCKETS;
+}
+
+/* find the entry for (host, port), creating it if asked.
+ caller holds pool_mutex */
+static struct pool_host *find_host(char *hostname, int port, int create)
+{
+    unsigned int b = pool_hash(hostname, port);
+    struct pool_host *ph = pool_table[b];
+
+    while (ph) {
+        if (ph->port == port && !strcmp(ph->hostname, hostname)) {
+            return ph;
+        }
+        ph = ph->next;
+    }
+    if (!create) {
+        return NULL;
+    }
+    ph = (struct pool_host *)Calloc(1, sizeof(struct pool_host));
+    ph->hostname = (char *)Malloc(strlen(hostname) + 1);
+    strcpy(ph->hostname, hostname);
+    ph->port = port;
+    ph->next = pool_table[b];
+    pool_table[b] = ph;
+    return ph;
+}
+
+/* close every idle connection that has been idle too long.
+ the list is newest first, so once one has expired the rest have too.
+ caller holds pool_mutex */
+static void expire_idle(struct pool_host *ph, time_t now)
+{
+    struct pool_conn **pp = &ph->idle;
+
+    while (*pp && now - (*pp)->since <= POOL_IDLE_TIMEOUT) {
+        pp = &((*pp)->next);
+    }
+    while (*pp) {
+        struct pool_conn *dead = *pp;
+        *pp = dead->next;
+        close(dead->fd);
+        Free(dead);
+        ph->nidle--;
+    }
+}
+
+/* reaper thread: expire idle connections all over the table, and
+ unlink the entries left empty */
+static void *reaper(void *vargp)
+{
+    struct pool_host **pp, *ph;
+    time_t now;
+    int b;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        Sleep(POOL_SWEEP_INTERVAL);
+        P(&pool_mutex);
+        now = time(NULL);
+        for (b = 0; b < POOL_BUCKETS; b++) {
+            pp = &pool_table[b];
+            while ((ph = *pp)) {
+                expire_idle(ph, now);
+                if (ph->nidle == 0) {
+                    *pp = ph->next;
+                    Free(ph->hostname);
+                    Free(ph);
+                }
+                else {
+                    pp = &ph->next;
+                }
+            }
+        }
+        V(&pool_mutex);
+    }
+    return NULL;
+}
+
+/* initialize the connection pool and start its reaper */
+void init_pool()
+{
+    pthread_t tid;
+
+    memset(pool_table, 0, sizeof(pool_table));
+    Sem_init(&pool_mutex, 0, 1);
+    Pthread_create(&tid, NULL, reaper, NULL);
+}
+
+/* take an idle connection to (host, port).
+ returns its descriptor, or -1 if there is none */
+int pool_get(char *hostname, int port)
+{
+    struct pool_host *ph;
+    struct pool_conn *pc;
+    int fd = -1;
+
+    P(&pool_mutex);
+    ph = find_host(hostname, port, 0);
+    if (ph) {
+        expire_idle(ph, time(NULL));
+        if ((pc = ph->idle)) {
+            ph->idle = pc->next;
+            ph->nidle--;
+            fd = pc->fd;
+            Free(pc);
+        }
+    }
+    V(&pool_mutex);
+    return fd;
+}
+
+/* give back a connection whose last response was read in full */
+void pool_put(char *hostname, int port, int fd)
+{
+    struct pool_host *ph;
+    struct pool_conn *pc;
+    time_t now = time(NULL);
+
+    P(&pool_mutex);
+    ph = find_host(hostname, port, 1);
+    expire_idle(ph, now);
+    if (ph->nidle >= POOL_MAX_PER_HOST) {
+        V(&pool_mutex);
+        close(fd);
+        return;
+    }
+    pc = (struct pool_conn *)Malloc(sizeof(struct pool_conn));
+    pc->fd = fd;
+    pc->since = now;
+    pc->next = ph->idle;
+    ph->idle = pc;
+    ph->nidle++;
+    V(&pool_mutex);
+}
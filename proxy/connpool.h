@@ -0,0 +1,34 @@
+#ifndef __CONNPOOL_H__
+#define __CONNPOOL_H__
+
+#include <time.h>
+#include "csapp.h"
+
+/* Upstream connection pool limits */
+#define POOL_BUCKETS 256        /* buckets in the (host, port) table */
+#define POOL_MAX_PER_HOST 8     /* idle connections kept per server */
+#define POOL_IDLE_TIMEOUT 10    /* seconds an idle connection is kept */
+#define POOL_SWEEP_INTERVAL 5   /* seconds between sweeps of the table */
+
+/* an idle, persistent connection to a web server */
+struct pool_conn{
+    int fd;
+    time_t since;               /* when it went idle */
+    struct pool_conn *next;
+};
+
+/* idle connections to one (host, port), newest first */
+struct pool_host{
+    char *hostname;
+    int port;
+    struct pool_conn *idle;
+    int nidle;
+    struct pool_host *next;
+};
+
+/* Function prototypes */
+void init_pool();
+int pool_get(char *hostname, int port);
+void pool_put(char *hostname, int port, int fd);
+
+#endif /* __CONNPOOL_H__ */
@@ -774,6 +774,82 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 /* $end rio_writen */
 
 
+/*
+ * Buffer pool for rio_t: free buffers of each pooled size, linked
+ * through their first bytes
+ */
+static char *rio_pool[RIO_POOL_CLASSES];
+static size_t rio_pool_free[RIO_POOL_CLASSES];  /* Bytes kept free */
+static pthread_mutex_t rio_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Pool class for a buffer size, or -1 if it is too big to pool */
+static int rio_pool_class(size_t size, size_t *classsize)
+{
+    int i;
+
+    *classsize = RIO_BUFSIZE;
+    for (i = 0; i < RIO_POOL_CLASSES; i++, *classsize *= 2)
+	if (size <= *classsize)
+	    return i;
+    *classsize = size;
+    return -1;
+}
+
+/*
+ * rio_bufget - Take a buffer of at least size bytes from the pool
+ */
+char *rio_bufget(size_t size)
+{
+    size_t classsize;
+    int i = rio_pool_class(size, &classsize);
+    char *buf = NULL;
+
+    if (i >= 0) {
+	pthread_mutex_lock(&rio_pool_lock);
+	if ((buf = rio_pool[i]) != NULL) {
+	    rio_pool[i] = *(char **)buf;
+	    rio_pool_free[i] -= classsize;
+	}
+	pthread_mutex_unlock(&rio_pool_lock);
+    }
+    if (buf == NULL)
+	buf = Malloc(classsize);
+    return buf;
+}
+
+/*
+ * rio_bufput - Give back a buffer taken with rio_bufget(size)
+ */
+void rio_bufput(char *buf, size_t size)
+{
+    size_t classsize;
+    int i = rio_pool_class(size, &classsize);
+
+    if (i >= 0) {
+	pthread_mutex_lock(&rio_pool_lock);
+	if (rio_pool_free[i] + classsize <= RIO_POOL_KEEP) {
+	    *(char **)buf = rio_pool[i];
+	    rio_pool[i] = buf;
+	    rio_pool_free[i] += classsize;
+	    buf = NULL;
+	}
+	pthread_mutex_unlock(&rio_pool_lock);
+    }
+    if (buf)
+	Free(buf);
+}
+
+/*
+ * rio_takebuf - Make sure there is an internal buffer to read into
+ */
+static void rio_takebuf(rio_t *rp)
+{
+    if (rp->rio_buf == NULL) {
+	rp->rio_buf = rio_bufget(rp->rio_size);
+	rp->rio_bufptr = rp->rio_buf;
+    }
+}
+
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -787,9 +863,10 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 {
     int cnt;
 
+    rio_takebuf(rp);
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
 	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
+			   rp->rio_size);
 	if (rp->rio_cnt < 0) {
 	    if (errno != EINTR) /* Interrupted by sig handler return */
 		return -1;
@@ -817,12 +894,61 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 /* $begin rio_readinitb */
 void rio_readinitb(rio_t *rp, int fd) 
 {
-    rp->rio_fd = fd;  
-    rp->rio_cnt = 0;  
-    rp->rio_bufptr = rp->rio_buf;
+    rio_readinitsz(rp, fd, RIO_BUFSIZE, RIO_BUFSIZE);
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_readinitsz - Like rio_readinitb, with a buffer of size bytes
+ *    that doubles, up to maxsize, when it fills up with unread bytes.
+ *    The buffer is taken from the pool on the first buffered read
+ *    and must be given back with rio_freeb.
+ */
+void rio_readinitsz(rio_t *rp, int fd, size_t size, size_t maxsize)
+{
+    rp->rio_fd = fd;
+    rp->rio_cnt = 0;
+    rp->rio_buf = NULL;
+    rp->rio_bufptr = NULL;
+    rp->rio_size = size;
+    rp->rio_maxsize = maxsize < size ? size : maxsize;
+}
+
+/*
+ * rio_freeb - Give the internal buffer back to the pool, dropping
+ *    any unread bytes
+ */
+void rio_freeb(rio_t *rp)
+{
+    if (rp->rio_buf) {
+	rio_bufput(rp->rio_buf, rp->rio_size);
+	rp->rio_buf = NULL;
+    }
+    rp->rio_bufptr = NULL;
+    rp->rio_cnt = 0;
+}
+
+/*
+ * rio_waitb - Wait until a socket has bytes to read. A rio_t with no
+ *    unread bytes gives its buffer back to the pool first, so an idle
+ *    connection holds none. Honors SO_RCVTIMEO. Returns 1 when there
+ *    is something to read, 0 on EOF, or -1 on error or timeout.
+ */
+ssize_t rio_waitb(rio_t *rp)
+{
+    ssize_t rc;
+    char c;
+
+    if (rp->rio_cnt > 0)
+	return 1;
+    rio_freeb(rp);
+    while ((rc = recv(rp->rio_fd, &c, 1, MSG_PEEK)) < 0) {
+	if (errno != EINTR) /* Interrupted by sig handler return */
+	    return -1;
+    }
+    return rc;
+}
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
@@ -845,37 +971,254 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 }
 /* $end rio_readnb */
 
+/*
+ * rio_readsome - Read up to n bytes (buffered) with at most one read().
+ *    Bytes already in the internal buffer are returned first. When it
+ *    is empty, read() goes straight into usrbuf, so large transfers are
+ *    not copied through rio_buf.
+ */
+ssize_t rio_readsome(rio_t *rp, void *usrbuf, size_t n)
+{
+    ssize_t cnt;
+
+    if (rp->rio_cnt > 0) {
+	cnt = n;
+	if ((size_t)rp->rio_cnt < n)
+	    cnt = rp->rio_cnt;
+	memcpy(usrbuf, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	return cnt;
+    }
+    while ((cnt = read(rp->rio_fd, usrbuf, n)) < 0) {
+	if (errno != EINTR) /* Interrupted by sig handler return */
+	    return -1;
+    }
+    return cnt;
+}
+
+/*
+ * rio_fill - Read more bytes into the internal buffer, behind the
+ *    ones not consumed yet, which are first moved to its front.
+ *    Lets a caller parse buffered bytes in place. A full buffer is
+ *    doubled while it is below its maximum size. Returns the number
+ *    of bytes read, 0 on EOF, or -1 on error, with errno ENOBUFS if
+ *    the buffer is full and may not grow.
+ */
+ssize_t rio_fill(rio_t *rp)
+{
+    ssize_t cnt;
+    size_t size;
+    char *buf;
+
+    rio_takebuf(rp);
+    if (rp->rio_cnt < 0)
+	rp->rio_cnt = 0;
+    if (rp->rio_bufptr != rp->rio_buf) {
+	memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	rp->rio_bufptr = rp->rio_buf;
+    }
+    if ((size_t)rp->rio_cnt == rp->rio_size) {
+	if (rp->rio_size >= rp->rio_maxsize) {
+	    errno = ENOBUFS;
+	    return -1;
+	}
+	size = rp->rio_size*2 < rp->rio_maxsize ? rp->rio_size*2
+	                                        : rp->rio_maxsize;
+	buf = rio_bufget(size);
+	memcpy(buf, rp->rio_buf, rp->rio_cnt);
+	rio_bufput(rp->rio_buf, rp->rio_size);
+	rp->rio_buf = rp->rio_bufptr = buf;
+	rp->rio_size = size;
+    }
+    while ((cnt = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+		       rp->rio_size - rp->rio_cnt)) < 0) {
+	if (errno != EINTR) /* Interrupted by sig handler return */
+	    return -1;
+    }
+    rp->rio_cnt += cnt;
+    return cnt;
+}
+
+/*
+ * rio_consume - Drop n buffered bytes that were used in place
+ */
+void rio_consume(rio_t *rp, size_t n)
+{
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+}
+
+/*
+ * rio_refill - Refill the internal buffer if it is empty. Returns the
+ *    number of unread bytes, 0 on EOF, or -1 on error.
+ */
+static ssize_t rio_refill(rio_t *rp)
+{
+    rio_takebuf(rp);
+    while (rp->rio_cnt <= 0) {
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, rp->rio_size);
+	if (rp->rio_cnt < 0) {
+	    if (errno != EINTR) /* Interrupted by sig handler return */
+		return -1;
+	}
+	else if (rp->rio_cnt == 0)  /* EOF */
+	    return 0;
+	else
+	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+    }
+    return rp->rio_cnt;
+}
+
 /* 
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered). The newline
+ *    is found with memchr and the line copied out a span at a time
+ *    rather than one byte per rio_read call.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1) {
-		return 0; /* EOF, no data read */
-            }
-	    else {
-		break;    /* EOF, some data was read */
-            }
-	} else
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
+
+    while (nl == NULL && n+1 < maxlen) {
+	if ((rc = rio_refill(rp)) < 0)
 	    return -1;	  /* Error */
+	else if (rc == 0)
+	    break;        /* EOF, with or without data read */
+	cnt = rp->rio_cnt;
+	if (cnt > maxlen-1 - n)
+	    cnt = maxlen-1 - n;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp + n, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	n += cnt;
     }
-    *bufp = '\0';
-    return n-1;
+    if (maxlen > 0)
+	bufp[n] = '\0';
+    return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_readlinev - Read a text line without copying it (buffered).
+ *    *linep is pointed at the line inside the internal buffer, newline
+ *    included but not NUL-terminated, and valid until the next call
+ *    on rp. A line longer than the largest buffer comes back in
+ *    pieces of that size. Returns the line length, 0 on EOF, or -1
+ *    on error.
+ */
+ssize_t rio_readlinev(rio_t *rp, char **linep)
+{
+    size_t scanned = 0, n;
+    ssize_t rc;
+    char *nl;
+
+    rio_takebuf(rp);
+    if (rp->rio_cnt < 0)
+	rp->rio_cnt = 0;
+    while ((nl = memchr(rp->rio_bufptr + scanned, '\n',
+			rp->rio_cnt - scanned)) == NULL) {
+	scanned = rp->rio_cnt;
+	if ((size_t)rp->rio_cnt == rp->rio_size && rp->rio_size >= rp->rio_maxsize)
+	    break;        /* no room to look further */
+	if ((rc = rio_fill(rp)) < 0)
+	    return -1;
+	else if (rc == 0)
+	    break;        /* EOF: what is left is the last line */
+    }
+    n = nl ? (size_t)(nl - rp->rio_bufptr + 1) : (size_t)rp->rio_cnt;
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+    return n;
+}
+
+/*
+ * rio_iovinit - Start an empty gathered output
+ */
+void rio_iovinit(rio_iov_t *vp)
+{
+    vp->rio_n = 0;
+    vp->rio_len = 0;
+}
+
+/*
+ * rio_iovadd - Append n bytes at buf to a gathered output.
+ *    Returns -1 if it already holds RIO_IOVMAX pieces.
+ */
+int rio_iovadd(rio_iov_t *vp, void *buf, size_t n)
+{
+    if (vp->rio_n == RIO_IOVMAX)
+	return -1;
+    if (n == 0)
+	return 0;
+    vp->rio_iov[vp->rio_n].iov_base = buf;
+    vp->rio_iov[vp->rio_n].iov_len = n;
+    vp->rio_n++;
+    vp->rio_len += n;
+    return 0;
+}
+
+/*
+ * rio_iovputs - Append a string to a gathered output
+ */
+int rio_iovputs(rio_iov_t *vp, char *s)
+{
+    return rio_iovadd(vp, s, strlen(s));
+}
+
+/*
+ * rio_writev_from - One writev() of a gathered output, skipping its
+ *    first off bytes. For non-blocking descriptors that resume where
+ *    the last write stopped. Returns what writev() returns.
+ */
+ssize_t rio_writev_from(int fd, rio_iov_t *vp, size_t off)
+{
+    struct iovec iov[RIO_IOVMAX];
+    int i = 0, n = 0;
+
+    while (i < vp->rio_n && off >= vp->rio_iov[i].iov_len) {
+	off -= vp->rio_iov[i].iov_len;
+	i++;
+    }
+    for (; i < vp->rio_n; i++, n++) {
+	iov[n] = vp->rio_iov[i];
+	if (n == 0) {
+	    iov[0].iov_base = (char *)iov[0].iov_base + off;
+	    iov[0].iov_len -= off;
+	}
+    }
+    return writev(fd, iov, n);
+}
+
+/*
+ * rio_writev - Robustly write a whole gathered output (unbuffered),
+ *    resuming after partial writes. Returns the number of bytes
+ *    written, or -1 on error.
+ */
+/* $begin rio_writev */
+ssize_t rio_writev(int fd, rio_iov_t *vp)
+{
+    size_t off = 0;
+    ssize_t nwritten;
+
+    while (off < vp->rio_len) {
+	if ((nwritten = rio_writev_from(fd, vp, off)) <= 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		continue;        /* and call writev() again */
+	    else
+		return -1;       /* errno set by writev() */
+	}
+	off += nwritten;
+    }
+    return vp->rio_len;
+}
+/* $end rio_writev */
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -957,11 +1300,12 @@ int open_clientfd(char *hostname, int port)
 
 
 /*
- * open_listenfd - open and return a listening socket on port
+ * open_listenfd_opt - open a listening socket on port, sharing the
+ *     port with other sockets opened with reuseport set
  *     Returns -1 and sets errno on Unix error.
  */
 /* $begin open_listenfd */
-int open_listenfd(int port)
+static int open_listenfd_opt(int port, int reuseport)
 {
     int listenfd, optval=1;
     struct sockaddr_in serveraddr;
@@ -974,6 +1318,12 @@ int open_listenfd(int port)
     if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
                    (const void *)&optval , sizeof(int)) < 0)
         return -1;
+
+    /* Lets several listening sockets share the port */
+    if (reuseport &&
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                   (const void *)&optval , sizeof(int)) < 0)
+        return -1;
     
     /* Listenfd will be an endpoint for all requests to port
      on any IP address for this host */
@@ -989,6 +1339,26 @@ int open_listenfd(int port)
         return -1;
     return listenfd;
 }
+
+/*
+ * open_listenfd - open and return a listening socket on port
+ *     Returns -1 and sets errno on Unix error.
+ */
+int open_listenfd(int port)
+{
+    return open_listenfd_opt(port, 0);
+}
+
+/*
+ * open_reuseport_listenfd - open a listening socket on port that
+ *     other sockets opened this way share; the kernel spreads new
+ *     connections across them (SO_REUSEPORT).
+ *     Returns -1 and sets errno on Unix error.
+ */
+int open_reuseport_listenfd(int port)
+{
+    return open_listenfd_opt(port, 1);
+}
 /* $end open_listenfd */
 
 /****************************************************
@@ -1015,6 +1385,15 @@ int Open_listenfd(int port)
         unix_error("Open_listenfd error");
     return rc;
 }
+
+int Open_reuseport_listenfd(int port)
+{
+    int rc;
+    
+    if ((rc = open_reuseport_listenfd(port)) < 0)
+        unix_error("Open_reuseport_listenfd error");
+    return rc;
+}
 /* $end csapp.c */
 
 
@@ -25,6 +25,7 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -47,10 +48,28 @@ typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     int rio_cnt;               /* Unread bytes in internal buf */
     char *rio_bufptr;          /* Next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *rio_buf;             /* Internal buffer, NULL until needed */
+    size_t rio_size;           /* Size of internal buf */
+    size_t rio_maxsize;        /* Size it may grow to when full */
 } rio_t;
 /* $end rio_t */
 
+/* Internal buffers come from a pool shared by all threads, in
+   RIO_POOL_CLASSES power-of-two sizes from RIO_BUFSIZE (8 KB to
+   256 KB). Up to RIO_POOL_KEEP bytes of each size are kept free for
+   reuse; bigger buffers are not pooled */
+#define RIO_POOL_CLASSES 6
+#define RIO_POOL_KEEP (2*1024*1024)
+
+/* Output gathered as pieces for one writev. The pieces are not
+   copied and must outlive the write */
+#define RIO_IOVMAX 96
+typedef struct {
+    struct iovec rio_iov[RIO_IOVMAX]; /* Pieces in order */
+    int rio_n;                 /* Pieces in use */
+    size_t rio_len;            /* Total bytes */
+} rio_iov_t;
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */ 
 extern char **environ; /* Defined by libc */
@@ -176,8 +195,22 @@ void V(sem_t *sem);
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
+void	rio_readinitsz(rio_t *rp, int fd, size_t size, size_t maxsize);
+void	rio_freeb(rio_t *rp);
+ssize_t	rio_waitb(rio_t *rp);
+char	*rio_bufget(size_t size);
+void	rio_bufput(char *buf, size_t size);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
+ssize_t	rio_readsome(rio_t *rp, void *usrbuf, size_t n);
+ssize_t	rio_fill(rio_t *rp);
+void	rio_consume(rio_t *rp, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_readlinev(rio_t *rp, char **linep);
+void	rio_iovinit(rio_iov_t *vp);
+int	rio_iovadd(rio_iov_t *vp, void *buf, size_t n);
+int	rio_iovputs(rio_iov_t *vp, char *s);
+ssize_t	rio_writev_from(int fd, rio_iov_t *vp, size_t off);
+ssize_t	rio_writev(int fd, rio_iov_t *vp);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
@@ -189,10 +222,12 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 /* Client/server helper functions */
 int open_clientfd(char *hostname, int port);
 int open_listenfd(int portno);
+int open_reuseport_listenfd(int portno);
 
 /* Wrappers for client/server helper functions */
 int Open_clientfd(char *hostname, int port);
 int Open_listenfd(int port);
+int Open_reuseport_listenfd(int port);
 
 #endif /* __CSAPP_H__ */
 /* $end csapp.h */
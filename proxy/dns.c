@@ -0,0 +1,320 @@
+/*
+   cache of host name lookups for upstream connects.
+
+   answers are kept for DNS_TTL seconds and failures for DNS_NEG_TTL,
+   so a miss only goes to the resolver once per name and interval.
+   lookups of a name that is already being resolved wait for that
+   resolution rather than starting another one.
+
+   dns_lookup resolves in the calling thread and may block.
+   dns_start never blocks: it hands the name to the resolver threads
+   and later posts a token to a queue the event loop watches.
+
+   with a hosts file given to init_dns, names are looked up in that
+   file alone ("address name [alias ...]" per line) instead of the
+   system resolver, which keeps tests off the network.
+ */
+
+#include "dns.h"
+
+/* Global variables */
+static struct dns_entry *dns_table[DNS_BUCKETS];
+static sem_t dns_mutex;
+static char *hosts_path=NULL;
+
+/* names waiting for a resolver thread */
+static struct dns_entry *queue_head=NULL, *queue_tail=NULL;
+static sem_t queue_items;
+
+/* hash of a name */
+static unsigned int dns_hash(char *name)
+{
+    unsigned int h = 2166136261u;
+    const unsigned char *p;
+
+    for (p = (const unsigned char *)name; *p; p++) {
+        h = (h ^ tolower(*p)) * 16777619u;
+    }
+    return h % DNS_BUCKETS;
+}
+
+/* look name up in the hosts file */
+static int resolve_hosts(char *name, struct in_addr *addr)
+{
+    char line[MAXLINE], *tok, *save;
+    struct in_addr a;
+    FILE *fp;
+    int found = 0;
+
+    if ((fp = fopen(hosts_path, "r")) == NULL) {
+        return 0;
+    }
+    while (!found && fgets(line, sizeof(line), fp)) {
+        if ((tok = strchr(line, '#'))) {
+            *tok = '\0';
+        }
+        if (!(tok = strtok_r(line, " \t\r\n", &save)) ||
+            !inet_aton(tok, &a)) {
+            continue;
+        }
+        while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+            if (!strcasecmp(tok, name)) {
+                *addr = a;
+                found = 1;
+                break;
+            }
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+/* ask the resolver. returns 1 and fills addr on success */
+static int resolve(char *name, struct in_addr *addr)
+{
+    struct addrinfo hints, *res;
+
+    if (hosts_path) {
+        return resolve_hosts(name, addr);
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(name, NULL, &hints, &res) != 0) {
+        return 0;
+    }
+    *addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    return 1;
+}
+
+/* find the entry for a name, making a new one when asked.
+ expired entries nobody is using are dropped from the bucket on
+ the way. caller holds dns_mutex */
+static struct dns_entry *find_entry(char *name, int create)
+{
+    struct dns_entry **pp = &dns_table[dns_hash(name)];
+    struct dns_entry *e;
+    time_t now = time(NULL);
+
+    while ((e = *pp)) {
+        if (!strcasecmp(e->name, name)) {
+            return e;
+        }
+        if (!e->busy && e->refs == 0 && e->expires <= now) {
+            *pp = e->next;
+            Free(e->name);
+            Free(e);
+            continue;
+        }
+        pp = &e->next;
+    }
+    if (!create) {
+        return NULL;
+    }
+    e = (struct dns_entry *)Calloc(1, sizeof(struct dns_entry));
+    e->name = (char *)Malloc(strlen(name)+1);
+    strcpy(e->name, name);
+    e->state = DNS_NONE;
+    Sem_init(&e->done, 0, 0);
+    *pp = e;
+    return e;
+}
+
+/* whether an entry holds an answer that is still good */
+static int fresh(struct dns_entry *e)
+{
+    return !e->busy && e->state != DNS_NONE && e->expires > time(NULL);
+}
+
+/* report the answer held by a settled entry: 1 with addr filled,
+ or -1 if the name did not resolve. caller holds dns_mutex */
+static int answer(struct dns_entry *e, struct in_addr *addr)
+{
+    if (e->state == DNS_OK) {
+        *addr = e->addr;
+        return 1;
+    }
+    return -1;
+}
+
+/* store the result of a resolution and wake everyone waiting on it */
+static void settle(struct dns_entry *e, int ok, struct in_addr addr)
+{
+    struct dns_waiter *w;
+
+    P(&dns_mutex);
+    e->state = ok ? DNS_OK : DNS_FAIL;
+    e->busy = 0;
+    e->addr = addr;
+    e->expires = time(NULL) + (ok ? DNS_TTL : DNS_NEG_TTL);
+    while (e->nsleep > 0) {
+        e->nsleep--;
+        V(&e->done);
+    }
+    w = e->async;
+    e->async = NULL;
+    V(&dns_mutex);
+
+    /* the event loops look the name up again when told */
+    while (w) {
+        struct dns_waiter *next = w->next;
+        wake_post(w->q, w->token);
+        Free(w);
+        w = next;
+    }
+}
+
+/* resolver thread: settle queued names one at a time */
+static void *resolver(void *vargp)
+{
+    struct dns_entry *e;
+    struct in_addr addr;
+    int ok;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        P(&queue_items);
+        P(&dns_mutex);
+        e = queue_head;
+        queue_head = e->qnext;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        V(&dns_mutex);
+
+        memset(&addr, 0, sizeof(addr));
+        ok = resolve(e->name, &addr);
+        settle(e, ok, addr);
+    }
+    return NULL;
+}
+
+/* set up the name cache and start the resolver threads.
+ hosts_file replaces the system resolver when not NULL */
+void init_dns(char *hosts_file)
+{
+    pthread_t tid;
+    int i;
+
+    memset(dns_table, 0, sizeof(dns_table));
+    Sem_init(&dns_mutex, 0, 1);
+    Sem_init(&queue_items, 0, 0);
+    hosts_path = hosts_file;
+    for (i = 0; i < DNS_THREADS; i++) {
+        Pthread_create(&tid, NULL, resolver, NULL);
+    }
+}
+
+/* look a name up, resolving it in this thread on a miss.
+ returns 1 with addr filled, or -1 if the name does not resolve */
+int dns_lookup(char *name, struct in_addr *addr)
+{
+    struct dns_entry *e;
+    struct in_addr a;
+    int ok, rc;
+
+    if (inet_aton(name, addr)) {
+        return 1;
+    }
+
+    P(&dns_mutex);
+    e = find_entry(name, 1);
+    if (fresh(e)) {
+        rc = answer(e, addr);
+        V(&dns_mutex);
+        return rc;
+    }
+    if (e->busy) {
+        /* someone else is resolving it: wait for their answer */
+        e->refs++;
+        e->nsleep++;
+        V(&dns_mutex);
+        P(&e->done);
+        P(&dns_mutex);
+        e->refs--;
+        rc = answer(e, addr);
+        V(&dns_mutex);
+        return rc;
+    }
+
+    /* resolve it here */
+    e->busy = 1;
+    V(&dns_mutex);
+
+    memset(&a, 0, sizeof(a));
+    ok = resolve(name, &a);
+    settle(e, ok, a);
+    *addr = a;
+    return ok ? 1 : -1;
+}
+
+/* look a name up without blocking. returns 1 with addr filled or -1
+ on a cached failure; otherwise returns 0 and posts token to q
+ once the answer is cached, when dns_start should be called again */
+int dns_start(char *name, struct in_addr *addr, struct wake_queue *q,
+              void *token)
+{
+    struct dns_entry *e;
+    struct dns_waiter *w;
+    int rc;
+
+    if (inet_aton(name, addr)) {
+        return 1;
+    }
+
+    P(&dns_mutex);
+    e = find_entry(name, 1);
+    if (fresh(e)) {
+        rc = answer(e, addr);
+        V(&dns_mutex);
+        return rc;
+    }
+
+    w = (struct dns_waiter *)Malloc(sizeof(struct dns_waiter));
+    w->q = q;
+    w->token = token;
+    w->next = e->async;
+    e->async = w;
+
+    /* the first to miss queues the name for the resolver threads */
+    if (!e->busy) {
+        e->busy = 1;
+        e->qnext = NULL;
+        if (queue_tail) {
+            queue_tail->qnext = e;
+        }
+        else {
+            queue_head = e;
+        }
+        queue_tail = e;
+        V(&queue_items);
+    }
+    V(&dns_mutex);
+    return 0;
+}
+
+/* open a connection to hostname:port through the name cache.
+ returns like open_clientfd: -2 if the name does not resolve,
+ -1 with errno set on any other error */
+int dns_connect(char *hostname, int port)
+{
+    struct sockaddr_in serveraddr;
+    int clientfd;
+
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    if (dns_lookup(hostname, &serveraddr.sin_addr) < 0) {
+        return -2;
+    }
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_port = htons(port);
+
+    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    if (connect(clientfd, (SA *) &serveraddr, sizeof(serveraddr)) < 0) {
+        close(clientfd);
+        return -1;
+    }
+    return clientfd;
+}
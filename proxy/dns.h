@@ -0,0 +1,48 @@
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include <time.h>
+#include "csapp.h"
+#include "wake.h"
+
+/* Name cache limits */
+#define DNS_BUCKETS 256         /* buckets in the name table */
+#define DNS_TTL 60              /* seconds an answer is trusted */
+#define DNS_NEG_TTL 5           /* seconds a failed lookup is remembered */
+#define DNS_THREADS 2           /* resolver threads for dns_start */
+
+enum dns_state { DNS_NONE, DNS_OK, DNS_FAIL };
+
+/* someone in an event loop waiting for a name: token is posted to
+ q once the answer is in */
+struct dns_waiter{
+    struct wake_queue *q;
+    void *token;
+    struct dns_waiter *next;
+};
+
+/* a name and its latest answer. while busy one resolution is under
+ way and every other lookup of the name waits for it instead of
+ starting its own */
+struct dns_entry{
+    char *name;
+    int state;                  /* DNS_NONE until the first answer */
+    int busy;
+    struct in_addr addr;
+    time_t expires;
+    int refs;                   /* lookups sleeping on, or reading, it */
+    int nsleep;                 /* of those, still asleep on done */
+    sem_t done;
+    struct dns_waiter *async;
+    struct dns_entry *next;     /* bucket chain */
+    struct dns_entry *qnext;    /* resolver queue */
+};
+
+/* Function prototypes */
+void init_dns(char *hosts_file);
+int dns_lookup(char *name, struct in_addr *addr);
+int dns_start(char *name, struct in_addr *addr, struct wake_queue *q,
+              void *token);
+int dns_connect(char *hostname, int port);
+
+#endif /* __DNS_H__ */
@@ -0,0 +1,290 @@
+/*
+   content codings of cached objects.
+
+   text responses are kept gzipped. the body is compressed once, when
+   the response goes into the cache, and the header block rewritten
+   to match, so the element is a complete gzipped response that is
+   sent as it is to clients accepting gzip. objects the web server
+   sent gzipped are kept the same way. a client that does not accept
+   gzip gets the header block without the coding and the body
+   inflated as it is written; its length is not known up front, so
+   that response is sent chunked to HTTP/1.1 clients and ends when
+   the connection closes for others.
+
+   a body gzipped here is not the bytes the origin's ETag stands
+   for, so the stored copy only carries the tag as a weak one.
+ */
+
+#include "encoding.h"
+#include "httpcache.h"
+
+/* is a content type worth compressing? */
+static int compressible(char *line, char *end)
+{
+    static char *types[] = { "text/", "application/json",
+        "application/javascript", "application/xml", "+xml", "+json" };
+    char *value = memchr(line, ':', end - line) + 1;
+    size_t len, i;
+    char *p;
+
+    for (p = value; p < end && *p != ';' && *p != '\r'; p++) {
+        for (i = 0; i < sizeof(types)/sizeof(types[0]); i++) {
+            len = strlen(types[i]);
+            if ((size_t)(end - p) >= len && !strncasecmp(p, types[i], len)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* does a client's Accept-Encoding take gzip? a q of 0 refuses it,
+ and * stands for every coding not named */
+int accepts_gzip(char *buf, struct http_request *req)
+{
+    char value[MAXLINE], *tok, *save, *q;
+    int i, ok, gzip = -1, any = -1;
+    size_t len;
+
+    for (i = 0; i < req->nheaders; i++) {
+        if (!http_span_is(buf, &req->headers[i].name, "Accept-Encoding")) {
+            continue;
+        }
+        http_span_copy(buf, &req->headers[i].value, value, sizeof(value));
+        for (tok = strtok_r(value, ",", &save); tok;
+             tok = strtok_r(NULL, ",", &save)) {
+            while (*tok == ' ' || *tok == '\t') {
+                tok++;
+            }
+            ok = !((q = strchr(tok, ';')) && (q = strstr(q, "q=")) &&
+                   atof(q+2) == 0);
+            len = strcspn(tok, " \t;");
+            if ((len == 4 && !strncasecmp(tok, "gzip", 4)) ||
+                (len == 6 && !strncasecmp(tok, "x-gzip", 6))) {
+                gzip = ok;
+            }
+            else if (len == 1 && *tok == '*') {
+                any = ok;
+            }
+        }
+    }
+    return gzip >= 0 ? gzip : any > 0;
+}
+
+/* make a gzipped copy of a plain 200 response with a text body and a
+ Content-Length. returns 0 unless that made it at least an eighth
+ smaller; otherwise *zp is the new object, to be freed by the caller */
+static int gzip_object(unsigned char *object, size_t obj_length,
+                       struct cache_meta *m, unsigned char **zp,
+                       size_t *zlen)
+{
+    char *p, *eol, *v, *end = (char *)object + m->body_off;
+    unsigned char *body = object + m->body_off, *zbody;
+    size_t body_len = obj_length - m->body_off, n;
+    long length = -1;
+    int minor, typed = 0;
+    z_stream zs;
+
+    if (m->body_off == 0 || body_len < GZIP_MIN_BODY ||
+        http_status_line((char *)object, m->body_off, &minor) != 200) {
+        return 0;
+    }
+    for (p = memchr(object, '\n', m->body_off) + 1; p < end; p = eol+1) {
+        eol = memchr(p, '\n', end - p);
+        if (http_line_is(p, eol, "Content-Encoding") ||
+            http_line_is(p, eol, "Transfer-Encoding") ||
+            http_line_is(p, eol, "Content-Range")) {
+            return 0;
+        }
+        if (http_line_is(p, eol, "Content-Type")) {
+            typed = compressible(p, eol);
+        }
+        else if (http_line_is(p, eol, "Content-Length")) {
+            length = atol(p + 15);
+        }
+    }
+    if (!typed || length != (long)body_len) {
+        return 0;
+    }
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+    n = deflateBound(&zs, body_len);
+    zbody = (unsigned char *)Malloc(n);
+    zs.next_in = body;
+    zs.avail_in = body_len;
+    zs.next_out = zbody;
+    zs.avail_out = n;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END ||
+        zs.total_out + body_len/8 >= body_len) {
+        deflateEnd(&zs);
+        Free(zbody);
+        return 0;
+    }
+    deflateEnd(&zs);
+
+    /* the header block less Content-Length and the blank line, with
+     a strong ETag made weak, the new coding and length, then the
+     compressed body */
+    *zp = (unsigned char *)Malloc(m->body_off + MAXLINE + zs.total_out);
+    *zlen = 0;
+    for (p = (char *)object; p < end; p = eol+1) {
+        eol = memchr(p, '\n', end - p);
+        if (*p == '\r' || *p == '\n' || http_line_is(p, eol, "Content-Length")) {
+            continue;
+        }
+        if (http_line_is(p, eol, "ETag")) {
+            for (v = p+5; v < eol && (*v == ' ' || *v == '\t'); v++) {
+            }
+            if (*v == '"') {
+                *zlen += sprintf((char *)*zp + *zlen, "ETag: W/");
+                memcpy(*zp + *zlen, v, eol+1 - v);
+                *zlen += eol+1 - v;
+                continue;
+            }
+        }
+        memcpy(*zp + *zlen, p, eol+1 - p);
+        *zlen += eol+1 - p;
+    }
+    *zlen += sprintf((char *)*zp + *zlen, "Content-Encoding: gzip\r\n"
+                     "Content-Length: %lu\r\nVary: Accept-Encoding\r\n\r\n",
+                     zs.total_out);
+    memcpy(*zp + *zlen, zbody, zs.total_out);
+    *zlen += zs.total_out;
+    Free(zbody);
+    return 1;
+}
+
+/* put a response into the cache, gzipped if that saves room */
+void insert_response(request_info *tag, unsigned char *object,
+                     size_t obj_length, int framed, struct cache_meta *meta)
+{
+    unsigned char *z;
+    size_t zlen;
+    struct cache_meta zmeta;
+
+    if (gzip_object(object, obj_length, meta, &z, &zlen)) {
+        if (parse_cache_meta(z, zlen, &zmeta)) {
+            insert_element(tag, z, zlen, 1, &zmeta);
+        }
+        Free(z);
+        return;
+    }
+    insert_element(tag, object, obj_length, framed, meta);
+}
+
+/* write the header block of a gzipped object as it is sent inflated:
+ without its coding and length, and either chunked or closing the
+ connection. returns its length, or 0 if it does not fit in size bytes */
+size_t gunzip_header(unsigned char *object, struct cache_meta *m,
+                     int chunked, char *out, size_t size)
+{
+    static char close_hdr[] = "Connection: close\r\n\r\n";
+    static char chunked_hdr[] = "Transfer-Encoding: chunked\r\n\r\n";
+    char *p, *eol, *end = (char *)object + m->body_off;
+    char *last = chunked ? chunked_hdr : close_hdr;
+    size_t len = 0, last_len = strlen(last);
+
+    for (p = (char *)object; p < end; p = eol+1) {
+        eol = memchr(p, '\n', end - p);
+        if (*p == '\r' || *p == '\n' ||
+            http_line_is(p, eol, "Content-Encoding") ||
+            http_line_is(p, eol, "Content-Length") ||
+            http_line_is(p, eol, "Connection") ||
+            http_line_is(p, eol, "Proxy-Connection") ||
+            http_line_is(p, eol, "Keep-Alive")) {
+            continue;
+        }
+        if (len + (eol+1 - p) + last_len > size) {
+            return 0;
+        }
+        memcpy(out + len, p, eol+1 - p);
+        len += eol+1 - p;
+    }
+    memcpy(out + len, last, last_len);
+    return len + last_len;
+}
+
+/* start inflating the body of a gzipped object. returns -1 on error */
+int gunzip_init(struct gunzip *g, unsigned char *object, size_t obj_length,
+                struct cache_meta *m)
+{
+    memset(g, 0, sizeof(*g));
+    if (inflateInit2(&g->zs, 16 + MAX_WBITS) != Z_OK) {
+        return -1;
+    }
+    g->zs.next_in = object + m->body_off;
+    g->zs.avail_in = obj_length - m->body_off;
+    return 0;
+}
+
+/* inflate up to size more bytes of the body into out. returns how
+ many, 0 at the end, or -1 if the body is corrupt */
+ssize_t gunzip_read(struct gunzip *g, char *out, size_t size)
+{
+    int rc;
+
+    g->zs.next_out = (unsigned char *)out;
+    g->zs.avail_out = size;
+    while (!g->done && g->zs.avail_out == size) {
+        rc = inflate(&g->zs, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END) {
+            /* gzip members may follow one another */
+            if (g->zs.avail_in > 0) {
+                inflateReset(&g->zs);
+            }
+            else {
+                g->done = 1;
+            }
+        }
+        else if (rc != Z_OK) {
+            return -1;
+        }
+    }
+    return size - g->zs.avail_out;
+}
+
+void gunzip_end(struct gunzip *g)
+{
+    inflateEnd(&g->zs);
+}
+
+/* write a gzipped object to a client inflated, as chunks if chunked
+ is set. returns -1 on error */
+int send_gunzipped(int fd, unsigned char *object, size_t obj_length,
+                   struct cache_meta *m, int chunked)
+{
+    char buf[GZIP_BLOCK], size[20];
+    struct gunzip g;
+    rio_iov_t out;
+    ssize_t n;
+    size_t len;
+
+    if ((len = gunzip_header(object, m, chunked, buf, sizeof(buf))) == 0 ||
+        rio_writen(fd, buf, len) < 0 ||
+        gunzip_init(&g, object, obj_length, m) < 0) {
+        return -1;
+    }
+    while ((n = gunzip_read(&g, buf, sizeof(buf))) > 0) {
+        rio_iovinit(&out);
+        if (chunked) {
+            rio_iovadd(&out, size,
+                       snprintf(size, sizeof(size), "%lx\r\n", (long)n));
+        }
+        rio_iovadd(&out, buf, n);
+        if (chunked) {
+            rio_iovputs(&out, "\r\n");
+        }
+        if (rio_writev(fd, &out) < 0) {
+            break;
+        }
+    }
+    gunzip_end(&g);
+    if (n == 0 && chunked && rio_writen(fd, "0\r\n\r\n", 5) < 0) {
+        return -1;
+    }
+    return n == 0 ? 0 : -1;
+}
@@ -0,0 +1,32 @@
+#ifndef __ENCODING_H__
+#define __ENCODING_H__
+
+#include <zlib.h>
+#include "cache.h"
+#include "httpparse.h"
+
+/* Compression of cached text objects */
+#define GZIP_LEVEL 6                /* zlib level used when storing */
+#define GZIP_MIN_BODY 256           /* smaller bodies are stored as they are */
+#define GZIP_BLOCK 16384            /* bytes inflated per step */
+
+/* a gzipped cached body being inflated for a client */
+struct gunzip{
+    z_stream zs;
+    int done;
+};
+
+/* Function prototypes */
+int accepts_gzip(char *buf, struct http_request *req);
+void insert_response(request_info *tag, unsigned char *object,
+                     size_t obj_length, int framed, struct cache_meta *meta);
+size_t gunzip_header(unsigned char *object, struct cache_meta *m,
+                     int chunked, char *out, size_t size);
+int gunzip_init(struct gunzip *g, unsigned char *object, size_t obj_length,
+                struct cache_meta *m);
+ssize_t gunzip_read(struct gunzip *g, char *out, size_t size);
+void gunzip_end(struct gunzip *g);
+int send_gunzipped(int fd, unsigned char *object, size_t obj_length,
+                   struct cache_meta *m, int chunked);
+
+#endif /* __ENCODING_H__ */
@@ -0,0 +1,1134 @@
+/*
+   event-driven front end for the proxy.
+
+   a single thread multiplexes every connection with epoll instead of
+   creating a thread per client. each connection is a small state
+   machine:
+
+     READ_REQ   -> reading the request header block from the client
+     COALESCING -> waiting for another connection fetching the same object
+     RESOLVING  -> waiting for a resolver thread to look up the server
+     CONNECTING -> non-blocking connect to the web server in progress
+     SEND_REQ   -> writing the rewritten request to the web server
+     RELAY      -> copying the response to the client, filling the cache
+     SEND_HIT   -> writing a cached object to the client
+     REPLY      -> writing an error or the stats, made by the proxy itself
+
+   name lookups go through the cache in dns.c. a miss is handed to
+   its resolver threads, which post the connection back to the loop's
+   wake queue (wake.c) when the answer is in, so the loop itself
+   never blocks on them.
+   a miss for an object another connection is already fetching waits
+   on that flight (flight.c) the same way, then tries the cache again.
+
+   all sockets are non-blocking. when the client cannot take more data
+   we stop reading from the server until the pending bytes drain.
+   a connection that sees no event for CONN_STALL_TIMEOUT seconds, a
+   silent client or server, is closed. every connection has the same
+   timeout, so a list kept in order of last activity is also in order
+   of deadline, and the loop only looks at its head.
+
+   a request for a byte range of a miss keeps the response to itself
+   until the header block is in. if the range can be answered, the
+   whole object is read for the cache and only the range sent;
+   otherwise what was kept is sent and the relay goes on as usual.
+
+   several loops may run at once, one per thread, each with its own
+   listening socket; what a loop owns is thread-local, and the caches
+   and flights they share are locked.
+ */
+
+#include <sys/epoll.h>
+#include "proxy.h"
+#include "l2cache.h"
+#include "dns.h"
+#include "flight.h"
+#include "httpcache.h"
+#include "encoding.h"
+#include "range.h"
+#include "stats.h"
+
+#define MAX_EVENTS 256
+
+enum conn_state { READ_REQ, COALESCING, RESOLVING, CONNECTING, SEND_REQ, RELAY, SEND_HIT, REPLY, CLOSED };
+
+/* how a ranged request is being relayed from the server */
+enum range_state { R_NONE, R_HEAD, R_BODY, R_DRAIN };
+
+struct conn;
+
+/* one end of a connection as registered with epoll */
+struct endpoint {
+    struct conn *c;
+    int fd;
+    unsigned int events;        /* current interest, 0 if unregistered */
+};
+
+/* per-connection state */
+struct conn {
+    int state;
+    struct endpoint client;
+    struct endpoint server;
+
+    /* request header block read from the client, parsed as it comes.
+     the buffer is taken from the rio pool when the first bytes arrive
+     and doubles up to MAX_REQUEST_HEADER */
+    char *inbuf;
+    size_t inlen, insize;
+    struct http_request req;
+
+    /* rewritten request going to the web server */
+    rio_iov_t out;
+    size_t reqoff;
+    request_info *tag;
+
+    /* pinned cache hit being written to the client, as the pieces in
+     hitout. a gzipped one for a client that does not take gzip is
+     inflated through relay instead */
+    struct cached_elem *hit;
+    rio_iov_t hitout;
+    size_t hitoff;
+    struct gunzip gz;
+    int inflating;
+
+    /* pinned stale copy the request asks the server to revalidate */
+    struct cached_elem *stale;
+
+    /* response bytes read from the server, or a reply of our own, not
+     yet sent to the client. RELAY_BLOCK bytes from the rio pool,
+     taken on the first read */
+    char *relay;
+    size_t rlen, roff;
+    int upstream_eof;
+
+    /* copy of the response kept for the cache */
+    unsigned char *object;
+    size_t obj_length, obj_cap;
+    int discard;
+
+    /* the answer to a byte range request, allocated if there is one,
+     and how much of it the client has */
+    struct range_reply *range;
+    int ranged;
+    size_t rsent;
+
+    /* fetch of the object this connection leads, if any, and
+     whether its response headers said it may be cached */
+    struct flight *flight;
+    int judged;
+    int waited;                 /* already waited on another's fetch */
+
+    /* a lookup or a flight still holds a pointer to us */
+    int parked;
+
+    /* for the stats: when the stage being timed began, 0 if none,
+     and when the request was parsed */
+    long t_stage;
+    long t_req;
+
+    /* when the connection is dropped unless something happens first,
+     and its place in the list of deadlines */
+    time_t deadline;
+    struct conn *tprev, *tnext;
+
+    struct conn *next_dead;
+};
+
+static __thread int epfd;
+static __thread struct conn *dead_list=NULL;
+static __thread struct wake_queue wakeq;   /* parked connections come back here */
+static __thread struct conn *timer_head=NULL, *timer_tail=NULL;
+
+/* make a descriptor non-blocking */
+static int set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* change the events epoll reports for an endpoint */
+static void watch(struct endpoint *ep, unsigned int events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (ep->events == events) {
+        return;
+    }
+    if (ep->events == 0) {
+        op = EPOLL_CTL_ADD;
+    }
+    else if (events == 0) {
+        op = EPOLL_CTL_DEL;
+    }
+    else {
+        op = EPOLL_CTL_MOD;
+    }
+    ev.events = events;
+    ev.data.ptr = ep;
+    if (epoll_ctl(epfd, op, ep->fd, &ev) < 0) {
+        unix_error("epoll_ctl error");
+    }
+    ep->events = events;
+}
+
+/* take a connection off the list of deadlines */
+static void timer_remove(struct conn *c)
+{
+    if (c->tprev) {
+        c->tprev->tnext = c->tnext;
+    }
+    else if (timer_head == c) {
+        timer_head = c->tnext;
+    }
+    else {
+        return;
+    }
+    if (c->tnext) {
+        c->tnext->tprev = c->tprev;
+    }
+    else {
+        timer_tail = c->tprev;
+    }
+    c->tprev = c->tnext = NULL;
+}
+
+/* the connection made progress: push its deadline back */
+static void touch(struct conn *c)
+{
+    timer_remove(c);
+    c->deadline = time(NULL) + CONN_STALL_TIMEOUT;
+    c->tprev = timer_tail;
+    if (timer_tail) {
+        timer_tail->tnext = c;
+    }
+    else {
+        timer_head = c;
+    }
+    timer_tail = c;
+}
+
+/* tear down a connection. the memory is freed after the current
+ batch of events, which may still refer to it */
+static void conn_close(struct conn *c)
+{
+    if (c->state == CLOSED) {
+        return;
+    }
+    if (c->client.fd >= 0) {
+        watch(&c->client, 0);
+        close(c->client.fd);
+    }
+    if (c->server.fd >= 0) {
+        watch(&c->server, 0);
+        close(c->server.fd);
+    }
+    if (c->hit) {
+        release_element(c->hit);
+    }
+    if (c->stale) {
+        release_element(c->stale);
+    }
+    if (c->tag) {
+        Free(c->tag);
+    }
+    if (c->object) {
+        Free(c->object);
+    }
+    if (c->range) {
+        Free(c->range);
+    }
+    if (c->inbuf) {
+        rio_bufput(c->inbuf, c->insize);
+    }
+    if (c->relay) {
+        rio_bufput(c->relay, RELAY_BLOCK);
+    }
+    if (c->flight) {
+        flight_end(c->flight);
+    }
+    if (c->inflating) {
+        gunzip_end(&c->gz);
+    }
+    if (c->t_req) {
+        stats_time(STAGE_TOTAL, c->t_req);
+    }
+    timer_remove(c);
+    c->state = CLOSED;
+    /* a parked connection is freed when it comes back instead */
+    if (!c->parked) {
+        c->next_dead = dead_list;
+        dead_list = c;
+    }
+}
+
+/* free connections closed during the last batch of events */
+static void reap_dead()
+{
+    while (dead_list) {
+        struct conn *c = dead_list;
+        dead_list = c->next_dead;
+        Free(c);
+    }
+}
+
+/* accept every pending connection on the listening socket */
+static void accept_conns(int listenfd)
+{
+    struct sockaddr_in clientaddr;
+    socklen_t clientlen;
+    int connfd;
+
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
+        if (connfd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* EAGAIN: drained; anything else: try again next time */
+            return;
+        }
+        set_nonblock(connfd);
+        stats_count(STAT_CONNS, 1);
+
+        struct conn *c = (struct conn *)Calloc(1, sizeof(struct conn));
+        c->state = READ_REQ;
+        c->client.c = c;
+        c->client.fd = connfd;
+        c->server.c = c;
+        c->server.fd = -1;
+        http_request_init(&c->req);
+        watch(&c->client, EPOLLIN);
+        touch(c);
+    }
+}
+
+/* keep a copy of relayed bytes for the cache while the object fits */
+static void fill_object(struct conn *c, char *buf, size_t n)
+{
+    if (c->discard) {
+        return;
+    }
+    if (c->obj_length + n > MAX_OBJECT_SIZE) {
+        c->discard = 1;
+        if (c->object) {
+            Free(c->object);
+            c->object = NULL;
+        }
+        return;
+    }
+    if (c->obj_length + n > c->obj_cap) {
+        size_t cap = c->obj_cap ? c->obj_cap : MAXBUF;
+        while (cap < c->obj_length + n) {
+            cap *= 2;
+        }
+        if (cap > MAX_OBJECT_SIZE) {
+            cap = MAX_OBJECT_SIZE;
+        }
+        c->object = (unsigned char *)Realloc(c->object, cap);
+        c->obj_cap = cap;
+    }
+    memcpy(c->object + c->obj_length, buf, n);
+    c->obj_length += n;
+}
+
+/* the misses waiting on our fetch only need to wait for the body if
+ it is going to be cached. once the header block is in, let them go
+ to the server themselves if it is not */
+static void judge_flight(struct conn *c)
+{
+    int rc;
+
+    if (c->flight == NULL || c->judged) {
+        return;
+    }
+    rc = c->discard ? 0 : response_cacheable(c->object, c->obj_length);
+    if (rc < 0) {
+        return;
+    }
+    c->judged = 1;
+    if (rc == 0) {
+        flight_end(c->flight);
+        c->flight = NULL;
+    }
+}
+
+/* the server closed and everything reached the client. the object
+ is cached only if it came in whole: all of its Content-Length, or
+ anything up to the close if it gave none. a cut-short one is
+ dropped, and the misses waiting on the flight fetch it themselves */
+static void finish_relay(struct conn *c)
+{
+    struct cache_meta meta;
+
+    if (!c->discard && parse_cache_meta(c->object, c->obj_length, &meta) &&
+        (meta.length < 0 ||
+         c->obj_length == meta.body_off + (size_t)meta.length)) {
+        insert_response(c->tag, c->object, c->obj_length, 0, &meta);
+    }
+    conn_close(c);
+}
+
+/* write pending relay bytes to the client.
+ returns 1 when drained, 0 if the client would block, -1 on error */
+static int flush_relay(struct conn *c)
+{
+    ssize_t n;
+
+    while (c->roff < c->rlen) {
+        n = write(c->client.fd, c->relay + c->roff, c->rlen - c->roff);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        c->roff += n;
+        stats_count(STAT_BYTES_RELAYED, n);
+    }
+    c->rlen = c->roff = 0;
+    return 1;
+}
+
+/* write the part of a ranged response the client has not had yet,
+ as far as the object has come in. the object may move as it grows,
+ so its piece is found again each time.
+ returns 1 when drained, 0 if the client would block, -1 on error */
+static int flush_range(struct conn *c)
+{
+    struct range_reply *r = c->range;
+    size_t end = c->obj_length < r->to ? c->obj_length : r->to;
+    rio_iov_t out;
+    ssize_t n;
+
+    rio_iovinit(&out);
+    rio_iovadd(&out, r->hdr, r->hdr_len);
+    if (end > r->from) {
+        rio_iovadd(&out, c->object + r->from, end - r->from);
+    }
+    while (c->rsent < out.rio_len) {
+        n = rio_writev_from(c->client.fd, &out, c->rsent);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        c->rsent += n;
+        stats_count(STAT_BYTES_RELAYED, n);
+    }
+    return 1;
+}
+
+/* a response to a ranged request came in: work out the reply once
+ its header block is in, then send what the client can have of it.
+ a response the range cannot be taken from goes out as it is.
+ returns as flush_range; nothing is pending while the header block
+ is still coming */
+static int relay_range(struct conn *c)
+{
+    struct range_reply *r = c->range;
+    int rc;
+
+    if (c->discard) {
+        return -1;
+    }
+    if (c->ranged == R_HEAD) {
+        rc = range_reply(c->inbuf, &c->req, c->object, c->obj_length, 0, r);
+        if (rc == RANGE_WAIT) {
+            return 1;
+        }
+        if (rc == RANGE_OK && r->total <= MAX_OBJECT_SIZE) {
+            c->ranged = R_BODY;
+        }
+        else {
+            c->ranged = R_DRAIN;
+            r->hdr_len = 0;
+            r->from = 0;
+            r->to = c->obj_length;
+        }
+    }
+    rc = flush_range(c);
+    if (rc > 0 && c->ranged == R_DRAIN) {
+        c->ranged = R_NONE;
+    }
+    return rc;
+}
+
+/* client is writable again while relaying */
+static void client_writable(struct conn *c)
+{
+    int rc = c->ranged ? flush_range(c) : flush_relay(c);
+
+    if (rc < 0) {
+        conn_close(c);
+        return;
+    }
+    if (rc == 0) {
+        return;
+    }
+    if (c->ranged == R_DRAIN) {
+        c->ranged = R_NONE;
+    }
+    if (c->upstream_eof) {
+        finish_relay(c);
+        return;
+    }
+    /* drained: go back to reading the server */
+    watch(&c->client, 0);
+    watch(&c->server, EPOLLIN);
+}
+
+/* write a pinned cache hit to the client: the whole object, or
+ the reply to the byte range the request asks for. as in
+ write_cached, a gzipped hit is never cut into ranges */
+static void start_hit(struct conn *c)
+{
+    struct cached_elem *hit = c->hit;
+    struct range_reply *r;
+
+    c->state = SEND_HIT;
+    rio_iovinit(&c->hitout);
+    c->hitoff = 0;
+    if (hit->meta.gzip && !accepts_gzip(c->inbuf, &c->req)) {
+        if (c->relay == NULL) {
+            c->relay = rio_bufget(RELAY_BLOCK);
+        }
+        c->roff = 0;
+        c->rlen = gunzip_header(hit->object, &hit->meta, 0, c->relay,
+                                RELAY_BLOCK);
+        if (c->rlen == 0 ||
+            gunzip_init(&c->gz, hit->object, hit->obj_length,
+                        &hit->meta) < 0) {
+            conn_close(c);
+            return;
+        }
+        c->inflating = 1;
+    }
+    else if (!hit->meta.gzip && range_asked(c->inbuf, &c->req)) {
+        if (c->range == NULL) {
+            c->range = (struct range_reply *)Malloc(sizeof(*c->range));
+        }
+        r = c->range;
+        if (range_reply(c->inbuf, &c->req, hit->object, hit->obj_length, 1,
+                        r) == RANGE_OK) {
+            rio_iovadd(&c->hitout, r->hdr, r->hdr_len);
+            rio_iovadd(&c->hitout, hit->object + r->from, r->to - r->from);
+        }
+    }
+    if (!c->inflating && c->hitout.rio_n == 0) {
+        rio_iovadd(&c->hitout, hit->object, hit->obj_length);
+    }
+    watch(&c->client, EPOLLOUT);
+}
+
+/* the server answered a conditional request with 304: renew the
+ stale copy with what the header block in relay says, and send it */
+static void revalidated(struct conn *c, struct cache_meta *meta)
+{
+    refresh_element(c->stale, meta);
+    stats_count(STAT_REVALIDATED, 1);
+    c->hit = c->stale;
+    c->stale = NULL;
+    c->rlen = 0;
+    watch(&c->server, 0);
+    close(c->server.fd);
+    c->server.fd = -1;
+    if (c->flight) {
+        flight_end(c->flight);
+        c->flight = NULL;
+    }
+    start_hit(c);
+}
+
+/* the answer to a conditional request is in relay as far as it has
+ come. a 304 renews the stale copy and sends it, and 1 is returned;
+ anything else is to be relayed and -1 is returned. returns 0 while
+ there is not enough of it to tell */
+static int answered(struct conn *c)
+{
+    struct cache_meta meta;
+    int minor, status;
+
+    status = http_status_line(c->relay, c->rlen, &minor);
+    if (status == 0 && c->rlen < RELAY_BLOCK) {
+        return 0;
+    }
+    if (status == 304) {
+        parse_cache_meta((unsigned char *)c->relay, c->rlen, &meta);
+        if (meta.body_off == 0 && c->rlen < RELAY_BLOCK) {
+            return 0;
+        }
+        revalidated(c, &meta);
+        return 1;
+    }
+    release_element(c->stale);
+    c->stale = NULL;
+    return -1;
+}
+
+/* server has response bytes for us */
+static void server_readable(struct conn *c)
+{
+    ssize_t n;
+    size_t off;
+    int rc;
+
+    if (c->relay == NULL) {
+        c->relay = rio_bufget(RELAY_BLOCK);
+    }
+    /* the answer to a conditional request is kept until it shows
+     whether it is a 304 */
+    off = c->stale ? c->rlen : 0;
+    n = read(c->server.fd, c->relay + off, RELAY_BLOCK - off);
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        conn_close(c);
+        return;
+    }
+    if (c->t_stage) {
+        stats_time(STAGE_TTFB, c->t_stage);
+        c->t_stage = 0;
+    }
+    if (n == 0) {
+        c->upstream_eof = 1;
+        finish_relay(c);
+        return;
+    }
+    if (c->stale) {
+        c->rlen += n;
+        if (answered(c) >= 0) {
+            return;
+        }
+        n = c->rlen;
+        c->rlen = 0;
+    }
+    fill_object(c, c->relay, n);
+    judge_flight(c);
+    if (c->ranged) {
+        rc = relay_range(c);
+    }
+    else {
+        c->rlen = n;
+        c->roff = 0;
+        rc = flush_relay(c);
+    }
+    if (rc < 0) {
+        conn_close(c);
+    }
+    else if (rc == 0) {
+        /* client is slow: stop reading the server until it catches up */
+        watch(&c->server, 0);
+        watch(&c->client, EPOLLOUT);
+    }
+}
+
+/* write the rewritten request to the server */
+static void send_request(struct conn *c)
+{
+    ssize_t n;
+
+    while (c->reqoff < c->out.rio_len) {
+        n = rio_writev_from(c->server.fd, &c->out, c->reqoff);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            conn_close(c);
+            return;
+        }
+        c->reqoff += n;
+    }
+    c->t_stage = stats_now();
+    c->state = RELAY;
+    watch(&c->server, EPOLLIN);
+}
+
+/* the non-blocking connect finished, one way or the other */
+static void server_connected(struct conn *c)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+        err != 0) {
+        stats_count(STAT_ERRORS, 1);
+        conn_close(c);
+        return;
+    }
+    stats_time(STAGE_CONNECT, c->t_stage);
+    c->state = SEND_REQ;
+    send_request(c);
+}
+
+/* start a non-blocking connect to the web server, looking its
+ name up first. if the name is not cached the connection waits in
+ RESOLVING and comes back here through wake_conns */
+static void connect_upstream(struct conn *c)
+{
+    struct sockaddr_in serveraddr;
+    int fd, rc;
+
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    rc = dns_start(c->tag->hostname, &serveraddr.sin_addr, &wakeq, c);
+    if (rc == 0) {
+        c->state = RESOLVING;
+        c->parked = 1;
+        watch(&c->client, 0);
+        return;
+    }
+    if (rc < 0) {
+        stats_count(STAT_ERRORS, 1);
+        conn_close(c);
+        return;
+    }
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_port = htons(c->tag->port);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        stats_count(STAT_ERRORS, 1);
+        conn_close(c);
+        return;
+    }
+    set_nonblock(fd);
+    c->server.fd = fd;
+    if (connect(fd, (SA *)&serveraddr, sizeof(serveraddr)) < 0 &&
+        errno != EINPROGRESS) {
+        stats_count(STAT_ERRORS, 1);
+        conn_close(c);
+        return;
+    }
+
+    c->state = CONNECTING;
+    watch(&c->client, 0);
+    watch(&c->server, EPOLLOUT);
+}
+
+/* look the object up in the memory cache. a fresh copy becomes the
+ hit and 1 is returned; a stale copy that can be revalidated is kept
+ in c->stale. a chunked copy, which only the threaded front end
+ stores, is left alone for an HTTP/1.0 client */
+static int take_cached(struct conn *c)
+{
+    struct cached_elem *elem;
+
+    if (c->stale) {
+        release_element(c->stale);
+        c->stale = NULL;
+    }
+    if ((elem = fetch_element(c->tag)) == NULL) {
+        return 0;
+    }
+    if (elem->meta.chunked &&
+        !http_span_is(c->inbuf, &c->req.version, "HTTP/1.1")) {
+        release_element(elem);
+        return 0;
+    }
+    if (cache_fresh(elem)) {
+        c->hit = elem;
+        return 1;
+    }
+    if (can_revalidate(elem)) {
+        c->stale = elem;
+    }
+    else {
+        release_element(elem);
+    }
+    return 0;
+}
+
+/* go to the web server for a miss, unless another connection is
+ already fetching the same object: then park until it is done */
+static void fetch_upstream(struct conn *c)
+{
+    if (!c->waited) {
+        if ((c->flight = flight_try(c->tag, &wakeq, c)) == NULL) {
+            c->state = COALESCING;
+            c->parked = 1;
+            watch(&c->client, 0);
+            return;
+        }
+        /* a flight may have ended between our miss and flight_try */
+        if (take_cached(c)) {
+            flight_end(c->flight);
+            c->flight = NULL;
+            stats_count(STAT_HITS, 1);
+            start_hit(c);
+            return;
+        }
+    }
+    stats_count(STAT_MISSES, 1);
+    if (range_asked(c->inbuf, &c->req)) {
+        if (c->range == NULL) {
+            c->range = (struct range_reply *)Malloc(sizeof(*c->range));
+        }
+        c->ranged = R_HEAD;
+    }
+    build_request(&c->out, c->inbuf, &c->req, c->tag, 0, c->stale);
+    c->t_stage = stats_now();
+    connect_upstream(c);
+}
+
+/* a name lookup or another connection's fetch finished: carry on
+ with the connections that waited for it, or free the ones that
+ were closed meanwhile */
+static void wake_conns()
+{
+    struct conn *c;
+
+    wake_clear(&wakeq);
+    while ((c = (struct conn *)wake_take(&wakeq)) != NULL) {
+        c->parked = 0;
+        if (c->state == CLOSED) {
+            c->next_dead = dead_list;
+            dead_list = c;
+        }
+        else if (c->state == RESOLVING) {
+            touch(c);
+            connect_upstream(c);
+        }
+        else {
+            /* the object should be cached now; if it is not, fetch
+             it without waiting again */
+            touch(c);
+            c->waited = 1;
+            if (take_cached(c)) {
+                stats_count(STAT_HITS, 1);
+                start_hit(c);
+            }
+            else {
+                fetch_upstream(c);
+            }
+        }
+    }
+}
+
+/* send the reply of our own now in relay, as the client takes it,
+ then close */
+static void start_reply(struct conn *c, size_t len)
+{
+    c->state = REPLY;
+    c->rlen = len;
+    c->roff = 0;
+    watch(&c->client, EPOLLOUT);
+}
+
+/* answer the request with an error message */
+static void reply_error(struct conn *c, char *cause, char *num,
+                        char *s_message, char *l_message)
+{
+    if (c->relay == NULL) {
+        c->relay = rio_bufget(RELAY_BLOCK);
+    }
+    start_reply(c, error_response(c->relay, RELAY_BLOCK, cause, num,
+                                  s_message, l_message));
+    stats_count(STAT_ERRORS, 1);
+}
+
+/* the whole header block is in inbuf and parsed: either serve it
+ from the cache or go to the web server */
+static void start_request(struct conn *c)
+{
+    char method[16], url[MAXLINE];
+    struct l2_hit l2hit;
+    struct cache_meta meta;
+    int hit, in_l2;
+    long start;
+
+    if (!http_span_is(c->inbuf, &c->req.method, "GET")) {
+        http_span_copy(c->inbuf, &c->req.method, method, sizeof(method));
+        reply_error(c, method, "501", "request not implemented", "none");
+        return;
+    }
+    if (http_span_copy(c->inbuf, &c->req.url, url, MAXLINE) >= MAXLINE) {
+        reply_error(c, "url", "414", "URI Too Long", "url too long");
+        return;
+    }
+    if (!strcmp(url, STATS_PATH)) {
+        c->relay = rio_bufget(RELAY_BLOCK);
+        start_reply(c, stats_response(c->relay, RELAY_BLOCK));
+        return;
+    }
+
+    c->tag = (request_info *)Malloc(sizeof(request_info));
+    c->tag->port = 80;
+    parse_url(url, c->tag->hostname, c->tag->uri, &c->tag->port);
+
+    /* look in memory, then in the disk tier */
+    start = stats_now();
+    hit = take_cached(c);
+    in_l2 = !hit && !c->stale && l2_get(c->tag, &l2hit);
+    stats_time(STAGE_LOOKUP, start);
+
+    /* if a fresh copy of the object is in the cache, send it to
+     client directly */
+    if (hit) {
+        stats_count(STAT_HITS, 1);
+        start_hit(c);
+        return;
+    }
+
+    /* an object found in the disk tier is brought back into memory
+     and served from there, or revalidated if it went stale */
+    if (in_l2) {
+        if (parse_cache_meta(l2hit.object, l2hit.obj_length, &meta)) {
+            insert_element(c->tag, l2hit.object, l2hit.obj_length,
+                           l2hit.framed, &meta);
+        }
+        l2_release(&l2hit);
+        if (take_cached(c)) {
+            stats_count(STAT_L2_HITS, 1);
+            start_hit(c);
+            return;
+        }
+    }
+    fetch_upstream(c);
+}
+
+/* client sent part of its request */
+static void client_readable(struct conn *c)
+{
+    ssize_t n;
+    int rc;
+    char *buf;
+
+    /* an idle connection holds no buffer until its request comes */
+    if (c->inbuf == NULL) {
+        c->insize = RIO_BUFSIZE;
+        c->inbuf = rio_bufget(c->insize);
+    }
+    else if (c->inlen == c->insize) {
+        buf = rio_bufget(c->insize*2);
+        memcpy(buf, c->inbuf, c->inlen);
+        rio_bufput(c->inbuf, c->insize);
+        c->inbuf = buf;
+        c->insize *= 2;
+    }
+    n = read(c->client.fd, c->inbuf + c->inlen, c->insize - c->inlen);
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        conn_close(c);
+        return;
+    }
+    if (n == 0) {
+        conn_close(c);
+        return;
+    }
+    if (c->inlen == 0) {
+        c->t_stage = stats_now();
+    }
+    c->inlen += n;
+
+    /* only the lines that just arrived are parsed */
+    rc = http_parse_request(&c->req, c->inbuf, c->inlen);
+    if (rc == HTTP_DONE) {
+        stats_time(STAGE_PARSE, c->t_stage);
+        stats_count(STAT_REQUESTS, 1);
+        c->t_stage = 0;
+        c->t_req = stats_now();
+        start_request(c);
+    }
+    else if (rc == HTTP_ERROR) {
+        reply_error(c, "request", "400", "bad request",
+                    "malformed request header");
+    }
+    else if (c->inlen == c->insize && c->insize >= MAX_REQUEST_HEADER) {
+        reply_error(c, "header", "431", "Request Header Fields Too Large",
+                    "request header too long");
+    }
+}
+
+/* write as much of an inflated hit as the client will take,
+ refilling relay as it drains */
+static void send_inflated(struct conn *c)
+{
+    ssize_t n;
+
+    while (1) {
+        if (c->roff == c->rlen) {
+            if ((n = gunzip_read(&c->gz, c->relay, RELAY_BLOCK)) <= 0) {
+                break;
+            }
+            c->rlen = n;
+            c->roff = 0;
+        }
+        n = write(c->client.fd, c->relay + c->roff, c->rlen - c->roff);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            break;
+        }
+        c->roff += n;
+        stats_count(STAT_BYTES_HIT, n);
+    }
+    conn_close(c);
+}
+
+/* write as much of a cached object as the client will take */
+static void send_hit(struct conn *c)
+{
+    ssize_t n;
+
+    if (c->inflating) {
+        send_inflated(c);
+        return;
+    }
+
+    while (c->hitoff < c->hitout.rio_len) {
+        n = rio_writev_from(c->client.fd, &c->hitout, c->hitoff);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            break;
+        }
+        c->hitoff += n;
+        stats_count(STAT_BYTES_HIT, n);
+    }
+    conn_close(c);
+}
+
+/* write as much of a reply of our own as the client will take */
+static void send_reply(struct conn *c)
+{
+    ssize_t n;
+
+    while (c->roff < c->rlen) {
+        n = write(c->client.fd, c->relay + c->roff, c->rlen - c->roff);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            break;
+        }
+        c->roff += n;
+    }
+    conn_close(c);
+}
+
+/* dispatch one epoll event to the state machine */
+static void handle_event(struct endpoint *ep)
+{
+    struct conn *c = ep->c;
+
+    touch(c);
+    if (ep == &c->client) {
+        switch (c->state) {
+            case READ_REQ:
+                client_readable(c);
+                break;
+            case RELAY:
+                client_writable(c);
+                break;
+            case SEND_HIT:
+                send_hit(c);
+                break;
+            case REPLY:
+                send_reply(c);
+                break;
+        }
+    }
+    else {
+        switch (c->state) {
+            case CONNECTING:
+                server_connected(c);
+                break;
+            case SEND_REQ:
+                send_request(c);
+                break;
+            case RELAY:
+                server_readable(c);
+                break;
+        }
+    }
+}
+
+/* close the connections whose deadline has passed, and return how
+ long epoll may wait for the next one, in ms, or -1 if there is none */
+static int expire_stalled()
+{
+    time_t now = time(NULL);
+
+    while (timer_head && timer_head->deadline <= now) {
+        conn_close(timer_head);
+    }
+    if (timer_head == NULL) {
+        return -1;
+    }
+    return (timer_head->deadline - now) * 1000;
+}
+
+/* run the proxy on the calling thread with epoll. never returns */
+void run_event_loop(int listenfd)
+{
+    struct epoll_event ev, events[MAX_EVENTS];
+    int n, i, timeout = -1;
+
+    if ((epfd = epoll_create1(0)) < 0) {
+        unix_error("epoll_create1 error");
+    }
+    set_nonblock(listenfd);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        unix_error("epoll_ctl error");
+    }
+    wake_init(&wakeq);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wakeq;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakeq.fd, &ev) < 0) {
+        unix_error("epoll_ctl error");
+    }
+
+    while (1) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            unix_error("epoll_wait error");
+        }
+        for (i = 0; i < n; i++) {
+            struct endpoint *ep = (struct endpoint *)events[i].data.ptr;
+            if (ep == NULL) {
+                accept_conns(listenfd);
+            }
+            else if ((void *)ep == (void *)&wakeq) {
+                wake_conns();
+            }
+            else if (ep->c->state != CLOSED) {
+                handle_event(ep);
+            }
+        }
+        timeout = expire_stalled();
+        reap_dead();
+    }
+}
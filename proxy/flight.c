@@ -0,0 +1,173 @@
+/*
+   request coalescing for cache misses.
+
+   the first miss for an object becomes the leader of a flight and
+   fetches it; misses for the same object that arrive while it is in
+   flight wait for the leader instead of going to the web server
+   themselves. when the leader is done they look in the cache again.
+   if the object did not make it into the cache (too big, or the
+   fetch failed) each of them fetches it on its own. a leader whose
+   response headers show it will not be cached ends the flight there
+   rather than after the body, and a sleeper gives up waiting after
+   FLIGHT_WAIT_TIMEOUT seconds.
+ */
+
+#include "flight.h"
+
+/* Global variables */
+static struct flight *flight_table[FLIGHT_BUCKETS];
+static sem_t flight_mutex;
+
+/* initialize the table of fetches in flight */
+void init_flights()
+{
+    memset(flight_table, 0, sizeof(flight_table));
+    Sem_init(&flight_mutex, 0, 1);
+}
+
+/* find the flight for a tag. caller holds flight_mutex */
+static struct flight *find_flight(request_info *tag, unsigned int h)
+{
+    struct flight *f = flight_table[h % FLIGHT_BUCKETS];
+
+    while (f) {
+        if (f->hash == h && f->port == tag->port &&
+            !strcmp(f->hostname, tag->hostname) &&
+            !strcmp(f->uri, tag->uri)) {
+            return f;
+        }
+        f = f->next;
+    }
+    return NULL;
+}
+
+/* start a flight for a tag, with the caller as its leader.
+ caller holds flight_mutex */
+static struct flight *new_flight(request_info *tag, unsigned int h)
+{
+    struct flight *f = (struct flight *)Calloc(1, sizeof(struct flight));
+
+    f->hash = h;
+    f->hostname = (char *)Malloc(strlen(tag->hostname)+1);
+    strcpy(f->hostname, tag->hostname);
+    f->uri = (char *)Malloc(strlen(tag->uri)+1);
+    strcpy(f->uri, tag->uri);
+    f->port = tag->port;
+    f->refs = 1;
+    Sem_init(&f->done, 0, 0);
+    f->next = flight_table[h % FLIGHT_BUCKETS];
+    flight_table[h % FLIGHT_BUCKETS] = f;
+    return f;
+}
+
+/* drop a reference, freeing the flight with the last one.
+ caller holds flight_mutex */
+static void flight_put(struct flight *f)
+{
+    f->refs--;
+    if (f->refs == 0) {
+        Free(f->hostname);
+        Free(f->uri);
+        Free(f);
+    }
+}
+
+/* sleep on a flight until it ends or FLIGHT_WAIT_TIMEOUT passes */
+static int flight_wait(struct flight *f)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += FLIGHT_WAIT_TIMEOUT;
+    while (sem_timedwait(&f->done, &ts) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* called on a miss. returns a flight if the caller should fetch the
+ object, and must flight_end it afterwards. if another fetch of the
+ object is in flight, sleeps until it ends, or for at most
+ FLIGHT_WAIT_TIMEOUT seconds, and returns NULL */
+struct flight *flight_begin(request_info *tag)
+{
+    unsigned int h = hash_tag(tag);
+    struct flight *f;
+    int rc;
+
+    P(&flight_mutex);
+    if ((f = find_flight(tag, h)) == NULL) {
+        f = new_flight(tag, h);
+        V(&flight_mutex);
+        return f;
+    }
+    f->refs++;
+    f->nsleep++;
+    V(&flight_mutex);
+
+    rc = flight_wait(f);
+
+    P(&flight_mutex);
+    /* gave up: unless the leader woke us meanwhile, it must not
+     count us among its sleepers any more */
+    if (rc < 0 && sem_trywait(&f->done) < 0) {
+        f->nsleep--;
+    }
+    flight_put(f);
+    V(&flight_mutex);
+    return NULL;
+}
+
+/* like flight_begin, but never sleeps: if another fetch is in flight,
+ returns NULL and posts token to q when that fetch ends */
+struct flight *flight_try(request_info *tag, struct wake_queue *q, void *token)
+{
+    unsigned int h = hash_tag(tag);
+    struct flight *f;
+    struct flight_waiter *w;
+
+    P(&flight_mutex);
+    if ((f = find_flight(tag, h)) == NULL) {
+        f = new_flight(tag, h);
+        V(&flight_mutex);
+        return f;
+    }
+    w = (struct flight_waiter *)Malloc(sizeof(struct flight_waiter));
+    w->q = q;
+    w->token = token;
+    w->next = f->async;
+    f->async = w;
+    V(&flight_mutex);
+    return NULL;
+}
+
+/* the leader is done: take the flight out of the table so the next
+ miss starts a new one, and wake everyone waiting on it */
+void flight_end(struct flight *f)
+{
+    struct flight **pp = &flight_table[f->hash % FLIGHT_BUCKETS];
+    struct flight_waiter *w;
+
+    P(&flight_mutex);
+    while (*pp != f) {
+        pp = &(*pp)->next;
+    }
+    *pp = f->next;
+    while (f->nsleep > 0) {
+        f->nsleep--;
+        V(&f->done);
+    }
+    w = f->async;
+    f->async = NULL;
+    flight_put(f);
+    V(&flight_mutex);
+
+    while (w) {
+        struct flight_waiter *next = w->next;
+        wake_post(w->q, w->token);
+        Free(w);
+        w = next;
+    }
+}
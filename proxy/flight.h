@@ -0,0 +1,41 @@
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include "cache.h"
+#include "wake.h"
+
+/* Buckets in the table of fetches in flight */
+#define FLIGHT_BUCKETS 256
+
+/* seconds a miss sleeps on another's fetch before fetching on its own */
+#define FLIGHT_WAIT_TIMEOUT 5
+
+/* someone in an event loop waiting on a fetch: token is posted to
+ q when it ends */
+struct flight_waiter{
+    struct wake_queue *q;
+    void *token;
+    struct flight_waiter *next;
+};
+
+/* a miss being fetched from the web server. later misses for the
+ same object wait for it, then look in the cache again */
+struct flight{
+    unsigned int hash;
+    char *hostname;
+    char *uri;
+    int port;
+    int refs;                   /* the leader plus every sleeper */
+    int nsleep;                 /* sleepers not yet woken */
+    sem_t done;
+    struct flight_waiter *async;
+    struct flight *next;
+};
+
+/* Function prototypes */
+void init_flights();
+struct flight *flight_begin(request_info *tag);
+struct flight *flight_try(request_info *tag, struct wake_queue *q, void *token);
+void flight_end(struct flight *f);
+
+#endif /* __FLIGHT_H__ */
@@ -0,0 +1,308 @@
+/*
+   HTTP caching rules for the proxy cache.
+
+   a cached object is the whole response, header block included, so
+   what it says about caching is read back from the object itself:
+   whether a shared cache may store it at all, how long it stays
+   fresh (s-maxage, max-age, Expires, or a heuristic), and which
+   validators (ETag, Last-Modified) can be used to revalidate it once
+   it is stale. a stale object with a validator is not fetched again;
+   the request goes out with If-None-Match / If-Modified-Since and a
+   304 answer lets the cached body be served as it is. where the body
+   starts and whether it is gzipped is noted too, for encoding.c.
+   a body in any other coding, or gzipped and chunked, is not stored,
+   since it could not be inflated for clients that do not take it.
+   a chunked body is noted as well: it cannot be sent to HTTP/1.0
+   clients as it is.
+ */
+
+#include "httpcache.h"
+#include "httpparse.h"
+
+/* seconds since the epoch of a civil date, in UTC */
+static time_t days_from_civil(int y, int m, int d)
+{
+    int era, yoe, doy, doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y-399) / 400;
+    yoe = y - era*400;
+    doy = (153*(m + (m > 2 ? -3 : 9)) + 2)/5 + d-1;
+    doe = yoe*365 + yoe/4 - yoe/100 + doy;
+    return (time_t)era*146097 + doe - 719468;
+}
+
+/* month number of a three letter name, or 0 */
+static int month_of(char *name)
+{
+    static char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                              "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    int i;
+
+    for (i = 0; i < 12; i++) {
+        if (!strcasecmp(name, months[i])) {
+            return i+1;
+        }
+    }
+    return 0;
+}
+
+/* parse an HTTP-date in any of the three formats HTTP allows.
+ returns -1 if it is not a date */
+time_t parse_http_date(char *s)
+{
+    char mon[4];
+    int y, d, hh, mm, ss, m;
+
+    /* Sun, 06 Nov 1994 08:49:37 GMT */
+    if (sscanf(s, "%*[a-zA-Z], %d %3s %d %d:%d:%d",
+               &d, mon, &y, &hh, &mm, &ss) != 6 &&
+        /* Sunday, 06-Nov-94 08:49:37 GMT */
+        sscanf(s, "%*[a-zA-Z], %d-%3s-%d %d:%d:%d",
+               &d, mon, &y, &hh, &mm, &ss) != 6 &&
+        /* Sun Nov  6 08:49:37 1994 */
+        sscanf(s, "%*s %3s %d %d:%d:%d %d",
+               mon, &d, &hh, &mm, &ss, &y) != 6) {
+        return -1;
+    }
+    if ((m = month_of(mon)) == 0) {
+        return -1;
+    }
+    if (y < 100) {
+        y += y < 70 ? 2000 : 1900;
+    }
+    return days_from_civil(y, m, d)*86400 + hh*3600 + mm*60 + ss;
+}
+
+/* whether a status may be cached without an explicit lifetime */
+static int heuristic_status(int status)
+{
+    switch (status) {
+        case 200: case 203: case 204: case 300: case 301: case 308:
+        case 404: case 405: case 410: case 414: case 501:
+            return 1;
+    }
+    return 0;
+}
+
+/* does a Cache-Control value hold directive name? if it has an
+ argument, store its number in *arg */
+static int has_directive(char *value, char *name, long *arg)
+{
+    size_t len = strlen(name);
+    char *p = value;
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        if (!strncasecmp(p, name, len) &&
+            (p[len] == '\0' || p[len] == ',' || p[len] == ' ' ||
+             p[len] == '=')) {
+            if (arg) {
+                *arg = p[len] == '=' ? atol(p+len+1 + (p[len+1] == '"'))
+                                     : 0;
+            }
+            return 1;
+        }
+        while (*p && *p != ',') {
+            p++;
+        }
+    }
+    return 0;
+}
+
+/* read the caching rules out of a response held in memory, header
+ block first. fills m and returns whether the response may be stored
+ by a shared cache */
+int parse_cache_meta(unsigned char *resp, size_t len, struct cache_meta *m)
+{
+    char *p = (char *)resp, *end = (char *)resp + len;
+    char *eol, *value, val[MAXLINE];
+    int status = 0, minor, no_store = 0, no_cache = 0, pragma = 0;
+    int has_cc = 0, gzip = 0, coded = 0, chunked = 0;
+    long max_age = -1, s_maxage = -1, age = 0;
+    time_t now = time(NULL), date = -1, expires = -1, lm = -1;
+    size_t vlen;
+
+    memset(m, 0, sizeof(*m));
+    m->length = -1;
+    if ((status = http_status_line(p, len, &minor)) <= 0) {
+        return 0;
+    }
+
+    /* every header line after the status line */
+    while ((eol = memchr(p, '\n', end-p)) != NULL) {
+        p = eol+1;
+        if (p >= end) {
+            break;
+        }
+        if (*p == '\r' || *p == '\n') {
+            m->body_off = p - (char *)resp + (*p == '\r' ? 2 : 1);
+            if (m->body_off > len) {
+                m->body_off = len;
+            }
+            break;
+        }
+        if ((value = memchr(p, ':', end-p)) == NULL) {
+            break;
+        }
+        value++;
+        while (value < end && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        eol = memchr(value, '\n', end-value);
+        vlen = (eol ? eol : end) - value;
+        while (vlen > 0 && (value[vlen-1] == '\r' || value[vlen-1] == ' ')) {
+            vlen--;
+        }
+        if (vlen >= sizeof(val)) {
+            continue;
+        }
+        memcpy(val, value, vlen);
+        val[vlen] = '\0';
+
+        if (!strncasecmp(p, "Cache-Control:", 14)) {
+            has_cc = 1;
+            if (has_directive(val, "no-store", NULL) ||
+                has_directive(val, "private", NULL)) {
+                no_store = 1;
+            }
+            if (has_directive(val, "no-cache", NULL)) {
+                no_cache = 1;
+            }
+            has_directive(val, "max-age", &max_age);
+            has_directive(val, "s-maxage", &s_maxage);
+        }
+        else if (!strncasecmp(p, "Pragma:", 7)) {
+            pragma = has_directive(val, "no-cache", NULL);
+        }
+        else if (!strncasecmp(p, "Expires:", 8)) {
+            /* an invalid date, such as 0, means already expired */
+            expires = parse_http_date(val);
+            if (expires < 0) {
+                expires = 0;
+            }
+        }
+        else if (!strncasecmp(p, "Date:", 5)) {
+            date = parse_http_date(val);
+        }
+        else if (!strncasecmp(p, "Last-Modified:", 14)) {
+            lm = parse_http_date(val);
+            m->lm_off = value - (char *)resp;
+            m->lm_len = vlen;
+        }
+        else if (!strncasecmp(p, "ETag:", 5)) {
+            m->etag_off = value - (char *)resp;
+            m->etag_len = vlen;
+        }
+        else if (!strncasecmp(p, "Age:", 4)) {
+            age = atol(val);
+        }
+        else if (!strncasecmp(p, "Content-Encoding:", 17)) {
+            if (!strcasecmp(val, "gzip") || !strcasecmp(val, "x-gzip")) {
+                gzip = 1;
+            }
+            else if (strcasecmp(val, "identity")) {
+                coded = 1;
+            }
+        }
+        else if (!strncasecmp(p, "Transfer-Encoding:", 18)) {
+            chunked = 1;
+        }
+        else if (!strncasecmp(p, "Content-Length:", 15)) {
+            m->length = atol(val);
+        }
+    }
+
+    /* freshness lifetime, shared cache rules first */
+    m->has_lifetime = 1;
+    if (s_maxage >= 0) {
+        m->lifetime = s_maxage;
+    }
+    else if (max_age >= 0) {
+        m->lifetime = max_age;
+    }
+    else if (expires >= 0) {
+        m->lifetime = expires - (date >= 0 ? date : now);
+    }
+    else {
+        m->has_lifetime = 0;
+        if (lm >= 0 && (date >= 0 ? date : now) > lm) {
+            m->lifetime = ((date >= 0 ? date : now) - lm) *
+            HEURISTIC_PERCENT / 100;
+            if (m->lifetime > HEURISTIC_MAX) {
+                m->lifetime = HEURISTIC_MAX;
+            }
+        }
+        else {
+            m->lifetime = HEURISTIC_DEFAULT;
+        }
+    }
+    if (no_cache || (!has_cc && pragma) || m->lifetime < 0) {
+        m->lifetime = 0;
+    }
+
+    /* age already spent in other caches or in flight */
+    if (date >= 0 && now - date > age) {
+        age = now - date;
+    }
+    if (age < 0) {
+        age = 0;
+    }
+    m->expires = now + m->lifetime - age;
+
+    /* only gzip can be undone for a client that does not take it,
+     and only once the chunked framing is off the body */
+    m->gzip = gzip && m->body_off > 0;
+    m->chunked = chunked && m->body_off > 0;
+    m->storable = !no_store && !coded && !(gzip && chunked) &&
+    (m->has_lifetime || heuristic_status(status));
+    return m->storable;
+}
+
+/* could a response end up in the cache, judging by its header block
+ alone: may it be stored, and does the length it gives, if any, fit?
+ returns -1 while the header block is still coming in */
+int response_cacheable(unsigned char *resp, size_t len)
+{
+    struct cache_meta m;
+    int storable = parse_cache_meta(resp, len, &m);
+
+    if (m.body_off == 0) {
+        return len < MAX_OBJECT_SIZE ? -1 : 0;
+    }
+    return storable &&
+    (m.length < 0 || m.body_off + m.length <= MAX_OBJECT_SIZE);
+}
+
+/* may a cached element be served without asking the server? */
+int cache_fresh(struct cached_elem *elem)
+{
+    return time(NULL) < element_expires(elem);
+}
+
+/* has a cached element a validator to revalidate it with? */
+int can_revalidate(struct cached_elem *elem)
+{
+    return elem->meta.etag_len > 0 || elem->meta.lm_len > 0;
+}
+
+/* add the conditional headers that revalidate a stale element to
+ an outgoing request. they point into the element, which must stay
+ pinned until the request is sent */
+void add_validators(rio_iov_t *out, struct cached_elem *elem)
+{
+    struct cache_meta *m = &elem->meta;
+
+    if (m->etag_len > 0) {
+        rio_iovputs(out, "If-None-Match: ");
+        rio_iovadd(out, elem->object + m->etag_off, m->etag_len);
+        rio_iovputs(out, "\r\n");
+    }
+    if (m->lm_len > 0) {
+        rio_iovputs(out, "If-Modified-Since: ");
+        rio_iovadd(out, elem->object + m->lm_off, m->lm_len);
+        rio_iovputs(out, "\r\n");
+    }
+}
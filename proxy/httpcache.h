@@ -0,0 +1,19 @@
+#ifndef __HTTPCACHE_H__
+#define __HTTPCACHE_H__
+
+#include "cache.h"
+
+/* Heuristic freshness for responses that give no lifetime of their own */
+#define HEURISTIC_PERCENT 10        /* of the time since Last-Modified */
+#define HEURISTIC_MAX 86400         /* seconds, upper bound */
+#define HEURISTIC_DEFAULT 60        /* seconds, without Last-Modified */
+
+/* Function prototypes */
+int parse_cache_meta(unsigned char *resp, size_t len, struct cache_meta *m);
+int response_cacheable(unsigned char *resp, size_t len);
+int cache_fresh(struct cached_elem *elem);
+int can_revalidate(struct cached_elem *elem);
+void add_validators(rio_iov_t *out, struct cached_elem *elem);
+time_t parse_http_date(char *s);
+
+#endif /* __HTTPCACHE_H__ */
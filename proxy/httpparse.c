@@ -0,0 +1,197 @@
+/*
+   incremental HTTP request parser and outgoing message builder.
+
+   http_parse_request is handed the bytes of a request received so
+   far and parses every complete line it has not seen yet, so each
+   byte is looked at once however many reads the request takes. it
+   copies nothing: the method, url, version and every header name and
+   value are recorded as spans of the caller's buffer.
+ */
+
+#include "httpparse.h"
+
+enum { REQ_LINE, HEADER_LINE, DONE };
+
+/* reset a parser for a new request */
+void http_request_init(struct http_request *r)
+{
+    r->state = REQ_LINE;
+    r->pos = 0;
+    r->len = 0;
+    r->nheaders = 0;
+}
+
+/* split the request line "method url version" */
+static int parse_request_line(struct http_request *r, char *buf,
+                              size_t start, size_t end)
+{
+    struct http_span *parts[3];
+    size_t i = start;
+    int k;
+
+    parts[0] = &r->method;
+    parts[1] = &r->url;
+    parts[2] = &r->version;
+    for (k = 0; k < 3; k++) {
+        while (i < end && buf[i] == ' ') {
+            i++;
+        }
+        parts[k]->off = i;
+        while (i < end && buf[i] != ' ') {
+            i++;
+        }
+        parts[k]->len = i - parts[k]->off;
+        if (parts[k]->len == 0) {
+            return HTTP_ERROR;
+        }
+    }
+    return HTTP_AGAIN;
+}
+
+/* split a header line "name: value" */
+static int parse_header_line(struct http_request *r, char *buf,
+                             size_t start, size_t end)
+{
+    struct http_header *h;
+    size_t i = start;
+
+    /* a folded line continues the previous value */
+    if (buf[start] == ' ' || buf[start] == '\t') {
+        if (r->nheaders == 0) {
+            return HTTP_ERROR;
+        }
+        h = &r->headers[r->nheaders-1];
+        h->value.len = end - h->value.off;
+        return HTTP_AGAIN;
+    }
+    if (r->nheaders == HTTP_MAX_HEADERS) {
+        return HTTP_ERROR;
+    }
+    while (i < end && buf[i] != ':') {
+        i++;
+    }
+    if (i == end || i == start) {
+        return HTTP_ERROR;
+    }
+    h = &r->headers[r->nheaders++];
+    h->name.off = start;
+    h->name.len = i - start;
+    i++;
+    while (i < end && (buf[i] == ' ' || buf[i] == '\t')) {
+        i++;
+    }
+    while (end > i && (buf[end-1] == ' ' || buf[end-1] == '\t')) {
+        end--;
+    }
+    h->value.off = i;
+    h->value.len = end - i;
+    return HTTP_AGAIN;
+}
+
+/* parse whatever complete lines of the request have arrived.
+ buf holds the first len bytes of the request; call again with the
+ same parser and more bytes while HTTP_AGAIN comes back. HTTP_DONE
+ means the blank line was seen and r->len is the size of the block */
+int http_parse_request(struct http_request *r, char *buf, size_t len)
+{
+    char *nl;
+    size_t start, end;
+    int rc;
+
+    while (r->state != DONE) {
+        start = r->pos;
+        if ((nl = memchr(buf + start, '\n', len - start)) == NULL) {
+            return HTTP_AGAIN;
+        }
+        r->pos = nl - buf + 1;
+        end = nl - buf;
+        if (end > start && buf[end-1] == '\r') {
+            end--;
+        }
+
+        if (r->state == REQ_LINE) {
+            /* blank lines before a request are ignored */
+            if (end == start) {
+                continue;
+            }
+            if ((rc = parse_request_line(r, buf, start, end)) < 0) {
+                return rc;
+            }
+            r->state = HEADER_LINE;
+        }
+        else if (end == start) {
+            r->state = DONE;
+            r->len = r->pos;
+        }
+        else if ((rc = parse_header_line(r, buf, start, end)) < 0) {
+            return rc;
+        }
+    }
+    return HTTP_DONE;
+}
+
+/* does a span hold str, ignoring case? */
+int http_span_is(char *buf, struct http_span *s, char *str)
+{
+    return strlen(str) == s->len && !strncasecmp(buf + s->off, str, s->len);
+}
+
+/* value of the first header with the given name, or NULL */
+struct http_span *http_header_value(struct http_request *r, char *buf,
+                                    char *name)
+{
+    int i;
+
+    for (i = 0; i < r->nheaders; i++) {
+        if (http_span_is(buf, &r->headers[i].name, name)) {
+            return &r->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+/* read the version and status code from the status line at the
+ start of len bytes of a response, which need not end in a NUL.
+ returns the status code with *minor set, 0 while the status line
+ is not all in, or -1 if it is not a status line */
+int http_status_line(char *resp, size_t len, int *minor)
+{
+    char line[32], *eol;
+    size_t n;
+    int status;
+
+    if ((eol = memchr(resp, '\n', len)) == NULL) {
+        return 0;
+    }
+    n = eol - resp;
+    if (n >= sizeof(line)) {
+        n = sizeof(line)-1;
+    }
+    memcpy(line, resp, n);
+    line[n] = '\0';
+    if (sscanf(line, "HTTP/1.%d %d", minor, &status) != 2 || status <= 0) {
+        return -1;
+    }
+    return status;
+}
+
+/* is a header line of a message, ending at end, the given header? */
+int http_line_is(char *line, char *end, char *name)
+{
+    size_t len = strlen(name);
+
+    return (size_t)(end - line) > len && !strncasecmp(line, name, len) &&
+    line[len] == ':';
+}
+
+/* copy a span out as a string, truncated to fit size bytes.
+ returns the length of the span */
+size_t http_span_copy(char *buf, struct http_span *s, char *dst,
+                      size_t size)
+{
+    size_t n = s->len < size ? s->len : size-1;
+
+    memcpy(dst, buf + s->off, n);
+    dst[n] = '\0';
+    return s->len;
+}
@@ -0,0 +1,50 @@
+#ifndef __HTTPPARSE_H__
+#define __HTTPPARSE_H__
+
+#include "csapp.h"
+
+/* Parser limits */
+#define HTTP_MAX_HEADERS 64     /* header lines kept per request */
+
+/* results of http_parse_request */
+#define HTTP_DONE 1
+#define HTTP_AGAIN 0
+#define HTTP_ERROR -1
+
+/* a piece of the request text: len bytes at offset off from the
+ start of the request. offsets rather than pointers, so the buffer
+ may be moved while more of the request is read */
+struct http_span{
+    size_t off;
+    size_t len;
+};
+
+struct http_header{
+    struct http_span name;
+    struct http_span value;
+};
+
+/* a request header block, parsed a line at a time as it arrives */
+struct http_request{
+    int state;                  /* which line comes next */
+    size_t pos;                 /* start of the first unparsed line */
+    size_t len;                 /* length of the whole block once done */
+    struct http_span method;
+    struct http_span url;
+    struct http_span version;
+    struct http_header headers[HTTP_MAX_HEADERS];
+    int nheaders;
+};
+
+/* Function prototypes */
+void http_request_init(struct http_request *r);
+int http_parse_request(struct http_request *r, char *buf, size_t len);
+struct http_span *http_header_value(struct http_request *r, char *buf,
+                                    char *name);
+int http_span_is(char *buf, struct http_span *s, char *str);
+int http_line_is(char *line, char *end, char *name);
+int http_status_line(char *resp, size_t len, int *minor);
+size_t http_span_copy(char *buf, struct http_span *s, char *dst,
+                      size_t size);
+
+#endif /* __HTTPPARSE_H__ */
@@ -0,0 +1,302 @@
+/*
+   disk-backed second tier for the proxy cache.
+
+   objects evicted from memory are appended to a ring of fixed-size,
+   memory-mapped segment files in a directory. a compact in-memory
+   index maps each tag to the record holding its latest copy. hits are
+   written to the client straight from the mapped pages.
+
+   when the ring wraps, the oldest segment is reclaimed: its index
+   entries are dropped and it is rewritten under a new generation.
+   on startup the index is rebuilt by scanning the segments in
+   generation order, so a warm cache survives a restart.
+ */
+
+#include "l2cache.h"
+
+/* Global variables */
+static struct l2_segment segs[L2_MAX_SEGS];
+static int cur_seg=0;
+static unsigned long long next_gen=1;
+static struct l2_entry **l2_index=NULL;
+static sem_t l2_mutex;
+
+/* record sizes are padded so headers stay aligned */
+static size_t rec_size(size_t keylen, size_t obj_length)
+{
+    return (sizeof(struct l2_rec) + keylen + obj_length + 7) & ~(size_t)7;
+}
+
+static struct l2_rec *rec_at(int seg, size_t off)
+{
+    return (struct l2_rec *)(segs[seg].base + off);
+}
+
+/* does the record hold this tag? */
+static int rec_matches(struct l2_rec *rec, request_info *req_hdr)
+{
+    return rec->port == req_hdr->port &&
+    !strcmp(rec->key, req_hdr->hostname) &&
+    !strcmp(rec->key + strlen(rec->key) + 1, req_hdr->uri);
+}
+
+/* find the index slot pointing at tag; caller holds l2_mutex */
+static struct l2_entry **index_find(request_info *req_hdr, unsigned int h)
+{
+    struct l2_entry **pp = &l2_index[h % L2_INDEX_BUCKETS];
+
+    while (*pp) {
+        if ((*pp)->hash == h &&
+            rec_matches(rec_at((*pp)->seg, (*pp)->off), req_hdr)) {
+            return pp;
+        }
+        pp = &((*pp)->next);
+    }
+    return NULL;
+}
+
+/* rebuild the tag of a record. returns 0 if its key is not a
+ hostname and a uri that fit in a tag */
+static int rec_tag(struct l2_rec *rec, request_info *req)
+{
+    size_t hlen = strnlen(rec->key, rec->keylen), ulen;
+
+    if (hlen + 1 >= rec->keylen || hlen >= sizeof(req->hostname)) {
+        return 0;
+    }
+    ulen = strnlen(rec->key + hlen + 1, rec->keylen - hlen - 1);
+    if (hlen + 1 + ulen >= rec->keylen || ulen >= sizeof(req->uri)) {
+        return 0;
+    }
+    memcpy(req->hostname, rec->key, hlen + 1);
+    memcpy(req->uri, rec->key + hlen + 1, ulen + 1);
+    req->port = rec->port;
+    return 1;
+}
+
+/* point the index at a record, replacing any older copy. a record
+ whose key does not make a tag is left out */
+static void index_add(int seg, size_t off)
+{
+    struct l2_rec *rec = rec_at(seg, off);
+    request_info req;
+    struct l2_entry **pp, *e;
+
+    if (!rec_tag(rec, &req)) {
+        return;
+    }
+    if ((pp = index_find(&req, rec->hash))) {
+        e = *pp;
+    }
+    else {
+        e = (struct l2_entry *)Malloc(sizeof(struct l2_entry));
+        e->hash = rec->hash;
+        e->next = l2_index[rec->hash % L2_INDEX_BUCKETS];
+        l2_index[rec->hash % L2_INDEX_BUCKETS] = e;
+    }
+    e->seg = seg;
+    e->off = off;
+}
+
+/* drop the index entry for a record if it still points there */
+static void index_drop(int seg, size_t off)
+{
+    struct l2_rec *rec = rec_at(seg, off);
+    struct l2_entry **pp = &l2_index[rec->hash % L2_INDEX_BUCKETS];
+
+    while (*pp) {
+        if ((*pp)->seg == seg && (*pp)->off == off) {
+            struct l2_entry *dead = *pp;
+            *pp = dead->next;
+            Free(dead);
+            return;
+        }
+        pp = &((*pp)->next);
+    }
+}
+
+/* call fn on every valid record of a segment, in order.
+ returns the offset just past the last one */
+static size_t scan_seg(int seg, void (*fn)(int seg, size_t off))
+{
+    struct l2_segment *sg = &segs[seg];
+    size_t off = sizeof(struct l2_seg_hdr);
+
+    while (off + sizeof(struct l2_rec) <= L2_SEG_SIZE) {
+        struct l2_rec *rec = rec_at(seg, off);
+        size_t len;
+        if (rec->magic != L2_REC_MAGIC || rec->gen != sg->gen ||
+            rec->keylen > L2_SEG_SIZE || rec->obj_length > L2_SEG_SIZE) {
+            break;
+        }
+        len = rec_size(rec->keylen, rec->obj_length);
+        if (off + len > L2_SEG_SIZE) {
+            break;
+        }
+        if (fn) {
+            fn(seg, off);
+        }
+        off += len;
+    }
+    return off;
+}
+
+/* start a segment over under a new generation; caller holds l2_mutex */
+static void reset_seg(int seg)
+{
+    struct l2_segment *sg = &segs[seg];
+    struct l2_seg_hdr *hdr = (struct l2_seg_hdr *)sg->base;
+
+    if (sg->gen) {
+        scan_seg(seg, index_drop);
+    }
+    sg->gen = next_gen++;
+    sg->used = sizeof(struct l2_seg_hdr);
+    hdr->magic = L2_SEG_MAGIC;
+    hdr->gen = sg->gen;
+}
+
+/* eviction callback: append the element to the current segment.
+ room is taken under the lock and the segment pinned; the copy into
+ the mapping, which may have to wait for the disk, is made without
+ the lock, and the record is published once it is whole */
+static void l2_put(struct cached_elem *elem, void *arg)
+{
+    size_t hlen = strlen(elem->hostname), ulen = strlen(elem->uri);
+    size_t keylen = hlen + ulen + 2;
+    size_t len = rec_size(keylen, elem->obj_length), off;
+    struct l2_rec *rec;
+    int seg, next;
+
+    if (len > L2_SEG_SIZE - sizeof(struct l2_seg_hdr)) {
+        return;
+    }
+
+    P(&l2_mutex);
+    if (segs[cur_seg].used + len > L2_SEG_SIZE) {
+        /* ring wraps onto the oldest segment. if a hit is still being
+         served from it, drop this object rather than overwrite */
+        next = (cur_seg + 1) % L2_MAX_SEGS;
+        if (segs[next].readers > 0) {
+            V(&l2_mutex);
+            return;
+        }
+        reset_seg(next);
+        cur_seg = next;
+    }
+    seg = cur_seg;
+    off = segs[seg].used;
+    segs[seg].used += len;
+    segs[seg].readers++;
+    rec = rec_at(seg, off);
+    rec->magic = 0;
+    rec->gen = segs[seg].gen;
+    V(&l2_mutex);
+
+    rec->hash = elem->hash;
+    rec->obj_length = elem->obj_length;
+    rec->port = elem->port;
+    rec->keylen = keylen;
+    rec->framed = elem->framed;
+    memcpy(rec->key, elem->hostname, hlen + 1);
+    memcpy(rec->key + hlen + 1, elem->uri, ulen + 1);
+    memcpy(rec->key + keylen, elem->object, elem->obj_length);
+
+    P(&l2_mutex);
+    rec->magic = L2_REC_MAGIC;
+    index_add(seg, off);
+    segs[seg].readers--;
+    V(&l2_mutex);
+}
+
+/* order segment numbers by generation, oldest first */
+static int gen_cmp(const void *a, const void *b)
+{
+    unsigned long long ga = segs[*(const int *)a].gen;
+    unsigned long long gb = segs[*(const int *)b].gen;
+    return (ga > gb) - (ga < gb);
+}
+
+/* open the segment files in dir, rebuild the index from them, and
+ start taking evictions from the memory cache */
+void init_l2(char *dir)
+{
+    char path[MAXLINE];
+    int order[L2_MAX_SEGS];
+    int i;
+    struct stat st;
+
+    l2_index = (struct l2_entry **)
+    Calloc(L2_INDEX_BUCKETS, sizeof(struct l2_entry *));
+    Sem_init(&l2_mutex, 0, 1);
+
+    for (i = 0; i < L2_MAX_SEGS; i++) {
+        struct l2_segment *sg = &segs[i];
+        struct l2_seg_hdr *hdr;
+
+        sprintf(path, "%s/seg.%d", dir, i);
+        sg->fd = Open(path, O_RDWR|O_CREAT, DEF_MODE);
+        Fstat(sg->fd, &st);
+        if (st.st_size < L2_SEG_SIZE && ftruncate(sg->fd, L2_SEG_SIZE) < 0) {
+            unix_error("init_l2: ftruncate error");
+        }
+        sg->base = Mmap(NULL, L2_SEG_SIZE, PROT_READ|PROT_WRITE,
+                        MAP_SHARED, sg->fd, 0);
+        sg->readers = 0;
+        hdr = (struct l2_seg_hdr *)sg->base;
+        sg->gen = (hdr->magic == L2_SEG_MAGIC) ? hdr->gen : 0;
+        if (sg->gen >= next_gen) {
+            next_gen = sg->gen + 1;
+        }
+        order[i] = i;
+    }
+
+    /* replay oldest to newest so later copies win */
+    qsort(order, L2_MAX_SEGS, sizeof(int), gen_cmp);
+    for (i = 0; i < L2_MAX_SEGS; i++) {
+        struct l2_segment *sg = &segs[order[i]];
+        sg->used = sg->gen ? scan_seg(order[i], index_add)
+                           : sizeof(struct l2_seg_hdr);
+    }
+
+    /* keep appending to the newest segment */
+    cur_seg = order[L2_MAX_SEGS-1];
+    if (segs[cur_seg].gen == 0) {
+        reset_seg(cur_seg);
+    }
+
+    set_evict_callback(l2_put, NULL);
+}
+
+/* look a tag up in the disk tier. on a hit the segment is pinned and
+ hit points into the mapping; the caller must l2_release it */
+int l2_get(request_info *req_hdr, struct l2_hit *hit)
+{
+    struct l2_entry **pp;
+    struct l2_rec *rec;
+
+    if (!l2_index) {
+        return 0;
+    }
+    P(&l2_mutex);
+    if (!(pp = index_find(req_hdr, hash_tag(req_hdr)))) {
+        V(&l2_mutex);
+        return 0;
+    }
+    rec = rec_at((*pp)->seg, (*pp)->off);
+    hit->seg = (*pp)->seg;
+    hit->object = (unsigned char *)rec->key + rec->keylen;
+    hit->obj_length = rec->obj_length;
+    hit->framed = rec->framed;
+    segs[hit->seg].readers++;
+    V(&l2_mutex);
+    return 1;
+}
+
+/* unpin a hit returned by l2_get */
+void l2_release(struct l2_hit *hit)
+{
+    P(&l2_mutex);
+    segs[hit->seg].readers--;
+    V(&l2_mutex);
+}
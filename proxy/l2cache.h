@@ -0,0 +1,65 @@
+#ifndef __L2CACHE_H__
+#define __L2CACHE_H__
+
+#include "cache.h"
+
+/* Disk tier geometry */
+#define L2_SEG_SIZE (16*1024*1024)  /* bytes per segment file */
+#define L2_MAX_SEGS 64              /* segment files in the ring */
+#define L2_INDEX_BUCKETS 65536      /* buckets in the in-memory index */
+#define L2_SEG_MAGIC 0x4c325347     /* "L2SG" */
+#define L2_REC_MAGIC 0x4c325243     /* "L2RC" */
+
+/* start of every segment file */
+struct l2_seg_hdr{
+    unsigned int magic;
+    unsigned int pad;
+    unsigned long long gen;         /* bumped each time it is rewritten */
+};
+
+/* one object in a segment: this header, the key (hostname\0uri\0),
+ then the object, padded to 8 bytes. magic is written last, so a
+ record cut short by a crash is never trusted */
+struct l2_rec{
+    unsigned int magic;
+    unsigned int hash;
+    unsigned long long gen;         /* generation of the segment */
+    unsigned long long obj_length;
+    int port;
+    unsigned int keylen;
+    int framed;
+    int pad;
+    char key[];
+};
+
+/* a mapped, append-only segment file */
+struct l2_segment{
+    int fd;
+    char *base;
+    size_t used;                    /* append offset */
+    unsigned long long gen;
+    int readers;                    /* hits served and records being copied */
+};
+
+/* index entry: where the latest copy of an object lives */
+struct l2_entry{
+    struct l2_entry *next;
+    unsigned int hash;
+    int seg;
+    size_t off;
+};
+
+/* a pinned L2 hit, valid until l2_release */
+struct l2_hit{
+    int seg;
+    unsigned char *object;
+    size_t obj_length;
+    int framed;
+};
+
+/* Function prototypes */
+void init_l2(char *dir);
+int l2_get(request_info *req_hdr, struct l2_hit *hit);
+void l2_release(struct l2_hit *hit);
+
+#endif /* __L2CACHE_H__ */
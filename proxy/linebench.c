@@ -0,0 +1,136 @@
+/*
+   linebench - time the rio line readers outside the proxy.
+
+   usage: linebench [-m megabytes] [-l lo:hi] [-x maxlen] [-S seed] [-v]
+
+   writes megabytes of text lines, each between lo and hi bytes with
+   its newline, to an unlinked temporary file, then reads them all
+   back through one rio_t with rio_readlineb into a maxlen buffer, or
+   with -v as views with rio_readlinev. the file stays in the page
+   cache, so the time is the reader's. reports MB/s and lines/s, and
+   the lines and bytes read back, which should match those written.
+
+   build: gcc -O2 -o linebench linebench.c csapp.c -lpthread
+ */
+
+#include "csapp.h"
+#include <getopt.h>
+
+/* a monotonic clock in nanoseconds */
+static long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-m megabytes] [-l lo:hi] [-x maxlen] "
+            "[-S seed] [-v]\n", prog);
+    exit(1);
+}
+
+/* fill fd with about size bytes of lines of lo to hi bytes, returning
+ the number of lines */
+static long write_lines(int fd, long size, int lo, int hi,
+                        unsigned short *seed)
+{
+    char buf[RIO_BUFSIZE + MAXLINE];
+    long lines = 0, done = 0;
+    size_t used = 0;
+    int len, i;
+
+    while (done + (long)used < size) {
+        len = lo + (int)(erand48(seed) * (hi - lo + 1));
+        for (i = 0; i < len-1; i++) {
+            buf[used+i] = 'a' + (lines+i)%26;
+        }
+        buf[used+len-1] = '\n';
+        used += len;
+        lines++;
+        if (used >= RIO_BUFSIZE) {
+            Rio_writen(fd, buf, used);
+            done += used;
+            used = 0;
+        }
+    }
+    Rio_writen(fd, buf, used);
+    return lines;
+}
+
+int main(int argc, char **argv)
+{
+    int opt, fd, lo = 10, hi = 140, views = 0;
+    long megabytes = 200, lines, got = 0, bytes = 0, start, ns;
+    size_t maxlen = MAXLINE;
+    unsigned short seed[3] = { 1, 2, 3 };
+    char name[] = "/tmp/linebenchXXXXXX", *buf, *line;
+    rio_t rio;
+    ssize_t n;
+
+    while ((opt = getopt(argc, argv, "m:l:x:S:v")) != -1) {
+        switch (opt) {
+            case 'm':
+                megabytes = atol(optarg);
+                break;
+            case 'l':
+                if (sscanf(optarg, "%d:%d", &lo, &hi) != 2) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'x':
+                maxlen = atol(optarg);
+                break;
+            case 'S':
+                seed[0] = atoi(optarg);
+                break;
+            case 'v':
+                views = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (megabytes < 1 || lo < 1 || hi < lo || hi > MAXLINE || maxlen < 2) {
+        usage(argv[0]);
+    }
+
+    if ((fd = mkstemp(name)) < 0) {
+        unix_error("mkstemp error");
+    }
+    unlink(name);
+    lines = write_lines(fd, megabytes << 20, lo, hi, seed);
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        unix_error("lseek error");
+    }
+
+    buf = (char *)Malloc(maxlen);
+    rio_readinitb(&rio, fd);
+    start = now_ns();
+    if (views) {
+        while ((n = rio_readlinev(&rio, &line)) > 0) {
+            got++;
+            bytes += n;
+        }
+    }
+    else {
+        while ((n = rio_readlineb(&rio, buf, maxlen)) > 0) {
+            got++;
+            bytes += n;
+        }
+    }
+    ns = now_ns() - start;
+    if (n < 0) {
+        unix_error("read error");
+    }
+
+    printf("%s lines:%ld of %ld bytes:%ld MB/s:%.0f lines/s:%.0f\n",
+           views ? "rio_readlinev" : "rio_readlineb", got, lines, bytes,
+           bytes*1e9/ns/(1<<20), got*1e9/ns);
+    rio_freeb(&rio);
+    Free(buf);
+    Close(fd);
+    return 0;
+}
@@ -0,0 +1,211 @@
+/*
+   replacement policies for the proxy cache.
+
+   lru      - one segment, evict the least recently used element.
+   slru     - segmented LRU. new elements enter a probationary segment
+              and move to a protected segment when hit again, so an
+              element seen only once cannot push out a hot one.
+   tinylfu  - W-TinyLFU. new elements enter a small LRU window. when
+              the window overflows, its oldest element only gets into
+              the main SLRU if a count-min sketch says it is accessed
+              more often than the element it would displace.
+
+   sizes are in bytes: each segment's cap is a share of the shard's
+   capacity, and elements are weighed by their charge.
+ */
+
+#include "cache.h"
+
+/* segment numbers */
+#define PROBATION 0
+#define PROTECTED 1
+#define WINDOW 2
+
+/* multipliers giving independent-ish hashes for each sketch row */
+static const unsigned int sketch_seeds[SKETCH_DEPTH] = {
+    0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu
+};
+
+/* counter slot for a tag hash in one row of the sketch */
+static unsigned int sketch_slot(unsigned int hash, int row)
+{
+    unsigned int h = hash * sketch_seeds[row];
+    return (h ^ (h >> 16)) & (SKETCH_WIDTH-1);
+}
+
+/* count one access. every 10*SKETCH_WIDTH accesses all counters are
+ halved, so old popularity fades */
+static void sketch_add(struct cache_shard *sh, unsigned int hash)
+{
+    int i, j;
+
+    for (i = 0; i < SKETCH_DEPTH; i++) {
+        unsigned char *c = &sh->sketch[i][sketch_slot(hash, i)];
+        if (*c < SKETCH_MAX) {
+            (*c)++;
+        }
+    }
+    if (++sh->sketch_adds >= 10*SKETCH_WIDTH) {
+        for (i = 0; i < SKETCH_DEPTH; i++) {
+            for (j = 0; j < SKETCH_WIDTH; j++) {
+                sh->sketch[i][j] >>= 1;
+            }
+        }
+        sh->sketch_adds /= 2;
+    }
+}
+
+/* estimated access count of a tag hash */
+static int sketch_freq(struct cache_shard *sh, unsigned int hash)
+{
+    int i, f = SKETCH_MAX;
+
+    for (i = 0; i < SKETCH_DEPTH; i++) {
+        int c = sh->sketch[i][sketch_slot(hash, i)];
+        if (c < f) {
+            f = c;
+        }
+    }
+    return f;
+}
+
+/********
+ * LRU
+ ********/
+static void lru_init(struct cache_shard *sh, size_t capacity)
+{
+    sh->seg[PROBATION].cap = capacity;
+}
+
+static void lru_hit(struct cache_shard *sh, struct cached_elem *elem)
+{
+    seg_move_front(sh, PROBATION, elem);
+}
+
+static void lru_add(struct cache_shard *sh, struct cached_elem *elem)
+{
+    seg_push_front(sh, PROBATION, elem);
+}
+
+static struct cached_elem *lru_victim(struct cache_shard *sh)
+{
+    return sh->seg[PROBATION].tail;
+}
+
+/********
+ * SLRU
+ ********/
+static void slru_init(struct cache_shard *sh, size_t capacity)
+{
+    sh->seg[PROBATION].cap = capacity/5;
+    sh->seg[PROTECTED].cap = capacity - capacity/5;
+}
+
+/* a hit promotes to the protected segment; whatever falls off the
+ end of it goes back to probation */
+static void slru_hit(struct cache_shard *sh, struct cached_elem *elem)
+{
+    struct lru_seg *prot = &sh->seg[PROTECTED];
+
+    seg_move_front(sh, PROTECTED, elem);
+    while (prot->bytes > prot->cap && prot->tail != elem) {
+        seg_move_front(sh, PROBATION, prot->tail);
+    }
+}
+
+static void slru_add(struct cache_shard *sh, struct cached_elem *elem)
+{
+    seg_push_front(sh, PROBATION, elem);
+}
+
+static struct cached_elem *slru_victim(struct cache_shard *sh)
+{
+    if (sh->seg[PROBATION].tail) {
+        return sh->seg[PROBATION].tail;
+    }
+    return sh->seg[PROTECTED].tail;
+}
+
+/************
+ * W-TinyLFU
+ ************/
+static void tinylfu_init(struct cache_shard *sh, size_t capacity)
+{
+    size_t window = capacity/100;
+    size_t main = capacity - window;
+
+    sh->seg[WINDOW].cap = window;
+    sh->seg[PROBATION].cap = main/5;
+    sh->seg[PROTECTED].cap = main - main/5;
+    memset(sh->sketch, 0, sizeof(sh->sketch));
+    sh->sketch_adds = 0;
+}
+
+static void tinylfu_access(struct cache_shard *sh, unsigned int hash)
+{
+    sketch_add(sh, hash);
+}
+
+static void tinylfu_hit(struct cache_shard *sh, struct cached_elem *elem)
+{
+    if (elem->seg == WINDOW) {
+        seg_move_front(sh, WINDOW, elem);
+    }
+    else {
+        slru_hit(sh, elem);
+    }
+}
+
+static void tinylfu_add(struct cache_shard *sh, struct cached_elem *elem)
+{
+    seg_push_front(sh, WINDOW, elem);
+}
+
+/* move window overflow into the main segments while there is room;
+ when there is not, the candidate and the main victim compete on
+ estimated frequency and the loser is evicted */
+static struct cached_elem *tinylfu_victim(struct cache_shard *sh)
+{
+    struct lru_seg *win = &sh->seg[WINDOW];
+    size_t main_cap = sh->seg[PROBATION].cap + sh->seg[PROTECTED].cap;
+    struct cached_elem *cand, *victim;
+
+    while (win->bytes > win->cap && win->tail) {
+        cand = win->tail;
+        victim = slru_victim(sh);
+        if (!victim || sh->seg[PROBATION].bytes + sh->seg[PROTECTED].bytes
+            + cand->charge <= main_cap) {
+            seg_move_front(sh, PROBATION, cand);
+            continue;
+        }
+        if (sketch_freq(sh, cand->hash) > sketch_freq(sh, victim->hash)) {
+            seg_move_front(sh, PROBATION, cand);
+            return victim;
+        }
+        return cand;
+    }
+    if ((victim = slru_victim(sh))) {
+        return victim;
+    }
+    return win->tail;
+}
+
+static struct cache_policy policies[] = {
+    { "lru", lru_init, NULL, lru_hit, lru_add, lru_victim },
+    { "slru", slru_init, NULL, slru_hit, slru_add, slru_victim },
+    { "tinylfu", tinylfu_init, tinylfu_access, tinylfu_hit, tinylfu_add,
+      tinylfu_victim },
+};
+
+/* look up a policy by name. returns NULL if there is none */
+struct cache_policy *find_policy(char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(policies)/sizeof(policies[0]); i++) {
+        if (!strcmp(policies[i].name, name)) {
+            return &policies[i];
+        }
+    }
+    return NULL;
+}
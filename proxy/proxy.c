@@ -21,155 +21,766 @@
  */
 
 #include <stdio.h>
-#include "cache.h"
+#include "proxy.h"
+#include "sbuf.h"
+#include "connpool.h"
+#include "l2cache.h"
+#include "dns.h"
+#include "flight.h"
+#include "httpcache.h"
+#include "encoding.h"
+#include "range.h"
+#include "stats.h"
 
 /* You won't lose style points for including these long lines in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
+static const char *accept_encoding_hdr = "Accept-Encoding: gzip\r\n";
+static const char *identity_hdr = "Accept-Encoding: identity\r\n";
 
 
-/* return an error message to proxy's client */
-void clienterror(int fd, char *cause, char *num,
-                 char *s_message, char *l_message)
+/* format an error message for proxy's client into buf, which
+ holds size bytes. returns its length */
+size_t error_response(char *buf, size_t size, char *cause, char *num,
+                      char *s_message, char *l_message)
 {
-    char buf[MAXLINE],body[MAXLINE];
+    char body[MAXLINE];
+    int blen, n;
     
     /* build body */
-    sprintf(body,"%s%s: %s\r\n",body,num,s_message);
-    sprintf(body,"%s<p>%s: %s\r\n", body, l_message, cause);
+    blen=snprintf(body,sizeof(body),"%s: %s\r\n<p>%s: %s\r\n",
+                  num,s_message,l_message,cause);
+    if (blen>=(int)sizeof(body)) {
+        blen=sizeof(body)-1;
+    }
+    
+    n=snprintf(buf,size,"HTTP/1.0 %s %s\r\nContent-type: text/html\r\n"
+               "Content-length: %d\r\n\r\n%s",num,s_message,blen,body);
+    return (size_t)n<size ? (size_t)n : size-1;
+}
 
+/* return an error message to proxy's client, in one write */
+void clienterror(int fd, char *cause, char *num,
+                 char *s_message, char *l_message)
+{
+    char buf[2*MAXLINE];
+    size_t n=error_response(buf,sizeof(buf),cause,num,s_message,l_message);
     
-    /* print response*/
-    sprintf(buf, "HTTP/1.0 %s %s\r\n",num,s_message);
-    rio_writen(fd,buf,strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    rio_writen(fd,buf,strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n",(int)strlen(body));
-    rio_writen(fd,buf,strlen(buf));
-    rio_writen(fd,body,strlen(body));
+    rio_writen(fd,buf,n);
+    stats_count(STAT_ERRORS,1);
 }
 
+/* format the answer to the admin path STATS_PATH into buf, which
+ holds size bytes. returns its length */
+size_t stats_response(char *buf, size_t size)
+{
+    char body[MAXBUF];
+    size_t len=stats_format(body,sizeof(body));
+    int n;
+    
+    n=snprintf(buf,size,"HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n"
+               "Content-Length: %zu\r\n\r\n%s",len,body);
+    return (size_t)n<size ? (size_t)n : size-1;
+}
 
-/* forward request to web server */
-void sendreq(request_info req_head, char *request, int client_fd)
+/* answer the admin path STATS_PATH with the proxy's statistics */
+void serve_stats(int fd)
 {
-    int proxy_clientfd;
-    unsigned char buf[MAXLINE];
-    unsigned char object[MAX_OBJECT_SIZE];
-    size_t obj_length, n, i;
-    rio_t rio;
-    int discard;
+    char buf[2*MAXBUF];
     
-    proxy_clientfd=Open_clientfd(req_head.hostname,req_head.port);
-    if (proxy_clientfd<0){
-        puts("open_clientfd error.\n");
-        return;
+    rio_writen(fd,buf,stats_response(buf,sizeof(buf)));
+}
+
+/* what the proxy needs to know from a response's headers */
+typedef struct {
+    int status;
+    long content_length;    /* -1 if there was no Content-Length */
+    int chunked;
+    int keepalive;          /* server keeps the connection open */
+} resp_info;
+
+/* case-insensitive search for word in a header value */
+static int has_word(char *value, char *word)
+{
+    size_t len = strlen(word);
+
+    for (; *value; value++) {
+        if (!strncasecmp(value, word, len)) {
+            return 1;
+        }
     }
-    Rio_readinitb(&rio,proxy_clientfd);
-    
-    rio_writen(proxy_clientfd,request,strlen(request));
-    
-    obj_length=0;
-    discard=0;
-    while ((n=rio_readlineb(&rio,buf,MAXLINE))!=0) {
-        rio_writen(client_fd, buf, n);
-        if (!discard) {
-            if (obj_length+n<=MAX_OBJECT_SIZE) {
-                for(i=0;i<n;i++){
-                    object[obj_length ++]=buf[i];
-                }
+    return 0;
+}
+
+/* if a header line of n bytes (not NUL-terminated) has the given
+ name, copy its value out as a string and return 1 */
+static int header_value(char *line, size_t n, char *name, char *val,
+                        size_t size)
+{
+    size_t len = strlen(name);
+
+    if (n < len || strncasecmp(line, name, len)) {
+        return 0;
+    }
+    n -= len;
+    if (n >= size) {
+        n = size-1;
+    }
+    memcpy(val, line+len, n);
+    val[n] = '\0';
+    return 1;
+}
+
+/* is a line of n bytes the empty line ending a header block? */
+static int blank_line(char *line, size_t n)
+{
+    return n == 2 && line[0] == '\r' && line[1] == '\n';
+}
+
+/* pick the framing headers out of one response header line */
+static void parse_resp_header(char *line, size_t n, resp_info *resp)
+{
+    char val[MAXLINE];
+
+    if (header_value(line, n, "Content-Length:", val, sizeof(val))) {
+        resp->content_length = atol(val);
+    }
+    else if (header_value(line, n, "Transfer-Encoding:", val, sizeof(val))) {
+        if (has_word(val, "chunked")) {
+            resp->chunked = 1;
+        }
+    }
+    else if (header_value(line, n, "Connection:", val, sizeof(val))) {
+        if (has_word(val, "close")) {
+            resp->keepalive = 0;
+        }
+        else if (has_word(val, "keep-alive")) {
+            resp->keepalive = 1;
+        }
+    }
+}
+
+/* copy of a response kept for the cache while it still fits.
+ the copy doubles as the client's output buffer: bytes added to it
+ are sent when the next read from the server could block, so headers,
+ chunk-size lines and data that arrived together leave in one write */
+typedef struct {
+    unsigned char *object;      /* MAX_OBJECT_SIZE bytes */
+    size_t obj_length;
+    size_t sent;                /* bytes of object sent to the client */
+    int discard;                /* response outgrew the object buffer */
+    unsigned char *scratch;     /* RELAY_BLOCK bytes, once discarding */
+} obj_fill;
+
+/* send the client the part of the copy it has not seen yet */
+static int flush_fill(int client_fd, obj_fill *f)
+{
+    if (f->sent < f->obj_length) {
+        if (rio_writen(client_fd, f->object + f->sent,
+                       f->obj_length - f->sent) < 0) {
+            return -1;
+        }
+        stats_count(STAT_BYTES_RELAYED, f->obj_length - f->sent);
+        f->sent = f->obj_length;
+    }
+    return 0;
+}
+
+/* flush before a read from the server that has to wait for data */
+static int flush_if_empty(rio_t *rp, int client_fd, obj_fill *f)
+{
+    return rp->rio_cnt > 0 ? 0 : flush_fill(client_fd, f);
+}
+
+/* pass a small piece of the response (a header or chunk-size line)
+ on to the client, keeping a copy for the cache while the object
+ still fits. returns -1 if the client is gone */
+static int forward(int client_fd, void *buf, size_t n, obj_fill *f)
+{
+    rio_iov_t out;
+
+    if (!f->discard) {
+        if (f->obj_length+n<=MAX_OBJECT_SIZE) {
+            memcpy(f->object + f->obj_length, buf, n);
+            f->obj_length += n;
+            return 0;
+        }
+        f->discard=1;
+    }
+    /* whatever is still pending goes out ahead of it */
+    rio_iovinit(&out);
+    rio_iovadd(&out, f->object + f->sent, f->obj_length - f->sent);
+    rio_iovadd(&out, buf, n);
+    f->sent = f->obj_length;
+    if (rio_writev(client_fd, &out) < 0) {
+        return -1;
+    }
+    stats_count(STAT_BYTES_RELAYED, out.rio_len);
+    return 0;
+}
+
+/* relay len body bytes, or everything up to EOF if len is -1, in
+ blocks of up to RELAY_BLOCK bytes. while the object can still fit,
+ bytes are read straight into the cache copy and written from there.
+ after that, once the rio buffer is drained, the rest is spliced from
+ socket to socket without entering user space; if splice is not
+ available it goes through a scratch block instead.
+ returns -1 on a short read or a client error */
+static int relay_body(rio_t *rp, long len, int client_fd, obj_fill *f)
+{
+    unsigned char *dst;
+    size_t want;
+    ssize_t n;
+    long moved;
+    int can_splice = 1;
+
+    while (len != 0) {
+        want = RELAY_BLOCK;
+        if (len > 0 && (size_t)len < want) {
+            want = len;
+        }
+        if (!f->discard && f->obj_length < MAX_OBJECT_SIZE) {
+            if (want > MAX_OBJECT_SIZE - f->obj_length) {
+                want = MAX_OBJECT_SIZE - f->obj_length;
+            }
+            dst = f->object + f->obj_length;
+        }
+        else if (can_splice && rp->rio_cnt == 0) {
+            if (flush_fill(client_fd, f) < 0) {
+                return -1;
             }
-            else{
-                discard=1;
+            moved = splice_relay(rp->rio_fd, client_fd, len);
+            if (moved == -2) {
+                can_splice = 0;
+                continue;
             }
+            if (moved < 0) {
+                return -1;
+            }
+            if (moved > 0) {
+                f->discard = 1;
+                stats_count(STAT_BYTES_RELAYED, moved);
+            }
+            return (len < 0 || moved == len) ? 0 : -1;
+        }
+        else {
+            if (!f->scratch) {
+                f->scratch = (unsigned char *)Malloc(RELAY_BLOCK);
+            }
+            dst = f->scratch;
+            if (flush_fill(client_fd, f) < 0) {
+                return -1;
+            }
+        }
+        
+        if (flush_if_empty(rp, client_fd, f) < 0 ||
+            (n = rio_readsome(rp, dst, want)) < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            /* EOF is only the end of the body if we were told so */
+            return len < 0 ? 0 : -1;
+        }
+        if (dst == f->scratch) {
+            f->discard = 1;
+            if (rio_writen(client_fd, dst, n) < 0) {
+                return -1;
+            }
+            stats_count(STAT_BYTES_RELAYED, n);
+        }
+        else {
+            f->obj_length += n;
+        }
+        if (len > 0) {
+            len -= n;
+        }
+    }
+    return 0;
+}
+
+/* read a body of len bytes whole into the cache copy, which it is
+ known to fit, sending the client only the part of the copy from
+ f->sent up to to. returns -1 on a short read or a client error */
+static int relay_range(rio_t *rp, long len, int client_fd, obj_fill *f,
+                       size_t to)
+{
+    size_t end;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = rio_readsome(rp, f->object + f->obj_length, len)) <= 0) {
+            return -1;
+        }
+        f->obj_length += n;
+        len -= n;
+        end = f->obj_length < to ? f->obj_length : to;
+        if (f->sent < end && (rp->rio_cnt == 0 || len == 0)) {
+            if (rio_writen(client_fd, f->object + f->sent, end - f->sent) < 0) {
+                return -1;
+            }
+            stats_count(STAT_BYTES_RELAYED, end - f->sent);
+            f->sent = end;
+        }
+    }
+    /* the rest of the copy is not for the client */
+    f->sent = f->obj_length;
+    return 0;
+}
+
+/* relay a chunked body up to and including its trailer.
+ lines are read as views into the rio buffer, not copied out */
+static int forward_chunked(rio_t *rp, int client_fd, obj_fill *f)
+{
+    char *line, hex[32];
+    ssize_t n;
+    size_t len;
+    long size;
+
+    while (1) {
+        if (flush_if_empty(rp, client_fd, f) < 0 ||
+            (n = rio_readlinev(rp, &line)) <= 0) {
+            return -1;
+        }
+        if (forward(client_fd, line, n, f) < 0) {
+            return -1;
+        }
+        len = (size_t)n < sizeof(hex) ? (size_t)n : sizeof(hex)-1;
+        memcpy(hex, line, len);
+        hex[len] = '\0';
+        size = strtol(hex, NULL, 16);
+        if (size <= 0) {
+            break;
+        }
+        /* chunk data plus its CRLF */
+        if (relay_body(rp, size+2, client_fd, f) < 0) {
+            return -1;
+        }
+    }
+    /* trailer headers end with an empty line */
+    do {
+        if (flush_if_empty(rp, client_fd, f) < 0 ||
+            (n = rio_readlinev(rp, &line)) <= 0) {
+            return -1;
+        }
+        if (forward(client_fd, line, n, f) < 0) {
+            return -1;
+        }
+    } while (!blank_line(line, n));
+    return 0;
+}
+
+/* read the response headers into the cache copy, to be sent with
+ the start of the body. a header block too big for the object buffer
+ is forwarded line by line instead. line holds the status line on
+ entry; the rest are read as views into the rio buffer */
+static int relay_headers(rio_t *rp, char *line, ssize_t n, int client_fd,
+                         obj_fill *f, resp_info *resp)
+{
+    while (1) {
+        if (forward(client_fd, line, n, f) < 0) {
+            return -1;
+        }
+        if (blank_line(line, n)) {
+            return 0;
         }
+        if ((n = rio_readlinev(rp, &line)) <= 0) {
+            return -1;
+        }
+        parse_resp_header(line, n, resp);
     }
-    Close(proxy_clientfd);
-    if (discard==0) {
-        insert_element(&req_head,object,obj_length);
+}
+
+/* read the header block of a response the client will not see,
+ keeping it in the object buffer. line holds the status line on entry */
+static int read_headers(rio_t *rp, char *line, ssize_t n, obj_fill *f,
+                        resp_info *resp)
+{
+    while (1) {
+        if (f->obj_length+n<=MAX_OBJECT_SIZE) {
+            memcpy(f->object + f->obj_length, line, n);
+            f->obj_length += n;
+        }
+        if (blank_line(line, n)) {
+            return 0;
+        }
+        if ((n = rio_readlinev(rp, &line)) <= 0) {
+            return -1;
+        }
+        parse_resp_header(line, n, resp);
     }
 }
 
-/* make the request and forward it to the web server */
-void serve_help(char *hostname,char *uri, request_info req_head,
-                int fd, int port, char *request, char *method, rio_t rio)
+/* write a cached response to the client for the request in buf:
+ inflated if it is gzipped and the client does not take gzip, in
+ chunks if it speaks HTTP/1.1, or just the byte range the request
+ asks for. a gzipped copy may have been gzipped here, so its bytes
+ need not be those a miss would take the range from: it is always
+ sent whole. framed says the response
+ tells the client where it ends. returns -1 on error, 0 if the
+ response ends with the connection and 1 otherwise */
+static int write_cached(int fd, unsigned char *object, size_t obj_length,
+                        int framed, struct cache_meta *m, char *buf,
+                        struct http_request *req)
 {
+    struct range_reply range;
+    rio_iov_t out;
+    int chunked;
     
-    /* make request */
-    strcpy(request,"");
-    sprintf(request,"%s %s HTTP/1.0\r\n",method,uri);
+    if (m->gzip && !accepts_gzip(buf,req)) {
+        chunked=http_span_is(buf,&req->version,"HTTP/1.1");
+        return send_gunzipped(fd,object,obj_length,m,chunked)<0 ? -1 : chunked;
+    }
+    if (!m->gzip &&
+        range_reply(buf,req,object,obj_length,1,&range)==RANGE_OK) {
+        rio_iovinit(&out);
+        rio_iovadd(&out,range.hdr,range.hdr_len);
+        rio_iovadd(&out,object+range.from,range.to-range.from);
+        return rio_writev(fd,&out)<0 ? -1 : 1;
+    }
+    if (rio_writen(fd,object,obj_length)<0) {
+        return -1;
+    }
+    return framed;
+}
 
-    rio_t *rp= &rio;
+/* forward request to web server.
+ the connection comes from the pool when one is idle, and goes back
+ to it when the response was framed and read in full.
+ stale is a pinned cached copy that has gone stale, or NULL. the
+ request then asks the server whether it changed, and if it did not
+ (304) the cached copy is renewed and sent to the client.
+ *flight is the fetch the caller leads, or NULL. it is ended, and
+ set to NULL, as soon as the response headers show the object will
+ not be cached, so the misses waiting on it need not wait for the body.
+ returns 1 if the response told the client where it ends, so the
+ client connection can carry another request */
+int sendreq(request_info *req_head, char *reqbuf, struct http_request *req,
+            int client_fd, struct cached_elem *stale, struct flight **flight)
+{
+    int proxy_clientfd, reused;
     char buf[MAXLINE];
-    /* to find whether request has its own host header.
-     0 means false, 1 means true */
-    int hashost=0;
-    rio_readlineb(rp,buf,MAXLINE);
-    if (strstr(buf,"Host:")) {
-        hashost=1;
-        sprintf(request,"%s%s",request,buf);
-    }
-    while (strcmp(buf,"\r\n")) {
-        rio_readlineb(rp,buf,MAXLINE);
-        if (strstr(buf,"Host:")) {
-            hashost=1;
-            sprintf(request,"%s %s",request,buf);
+    ssize_t n;
+    rio_t rio;
+    int ok, minor, framed, rc;
+    resp_info resp;
+    obj_fill fill;
+    struct range_reply range;
+    struct cache_meta meta;
+    rio_iov_t request;
+    long start;
+    
+    /* an HTTP/1.0 client could not take a chunked response, and
+     servers send none to an HTTP/1.0 request */
+    build_request(&request,reqbuf,req,req_head,
+                  http_span_is(reqbuf,&req->version,"HTTP/1.1"),stale);
+    while (1) {
+        start=stats_now();
+        proxy_clientfd=pool_get(req_head->hostname,req_head->port);
+        reused=(proxy_clientfd>=0);
+        if (!reused) {
+            proxy_clientfd=dns_connect(req_head->hostname,req_head->port);
+            if (proxy_clientfd<0){
+                stats_count(STAT_ERRORS,1);
+                return 0;
+            }
+        }
+        stats_time(STAGE_CONNECT,start);
+        Rio_readinitb(&rio,proxy_clientfd);
+        
+        start=stats_now();
+        if (rio_writev(proxy_clientfd,&request)>=0 &&
+            (n=rio_readlineb(&rio,buf,MAXLINE))>0) {
+            stats_time(STAGE_TTFB,start);
+            break;
+        }
+        rio_freeb(&rio);
+        Close(proxy_clientfd);
+        /* a pooled connection may have been closed by the server
+         while idle; try again on another one */
+        if (!reused) {
+            stats_count(STAT_ERRORS,1);
+            return 0;
         }
     }
     
-    if (hashost==0) {
-        sprintf(request,"%sHost: %s\r\n",request,hostname);
+    fill.object=(unsigned char *)Malloc(MAX_OBJECT_SIZE);
+    fill.obj_length=0;
+    fill.sent=0;
+    fill.discard=0;
+    fill.scratch=NULL;
+    
+    /* status line and headers */
+    resp.status=0;
+    resp.content_length=-1;
+    resp.chunked=0;
+    minor=0;
+    sscanf(buf,"HTTP/1.%d %d",&minor,&resp.status);
+    resp.keepalive=(minor>=1);
+    
+    /* not modified: the cached copy is still good, and the
+     304 may carry a new lifetime for it */
+    if (stale && resp.status==304) {
+        rc=0;
+        ok=(read_headers(&rio,buf,n,&fill,&resp)==0);
+        if (ok) {
+            parse_cache_meta(fill.object,fill.obj_length,&meta);
+            refresh_element(stale,&meta);
+            rc=write_cached(client_fd,stale->object,stale->obj_length,
+                            stale->framed,&stale->meta,reqbuf,req);
+            ok=(rc>=0);
+            stats_count(STAT_REVALIDATED,1);
+            stats_count(STAT_BYTES_HIT,stale->obj_length);
+        }
+        if (ok && resp.keepalive && rio.rio_cnt==0) {
+            pool_put(req_head->hostname,req_head->port,proxy_clientfd);
+        }
+        else {
+            Close(proxy_clientfd);
+        }
+        rio_freeb(&rio);
+        Free(fill.object);
+        return ok && rc>0;
     }
     
-    sprintf(request,"%s%s",request,user_agent_hdr);
-    sprintf(request,"%s%s",request,accept_hdr);
-    sprintf(request,"%s%s",request, accept_encoding_hdr);
-    sprintf(request,"%sConnection: close\r\n",request);
-    sprintf(request,"%sProxy-Connection:close\r\n",request);
-    sprintf(request,"%s\r\n",request);
+    ok=(relay_headers(&rio,buf,n,client_fd,&fill,&resp)==0);
+    if (*flight && (!ok || fill.discard ||
+                    response_cacheable(fill.object,fill.obj_length)!=1)) {
+        flight_end(*flight);
+        *flight=NULL;
+    }
     
-    /* find req web object in web cache */
-    strcpy(req_head.hostname,hostname);
-    strcpy(req_head.uri,uri);
-    req_head.port=port;
+    /* body */
+    framed=1;
+    if (ok && !fill.discard && resp.content_length>=0 &&
+        range_reply(reqbuf,req,fill.object,fill.obj_length,0,&range)==RANGE_OK &&
+        range.total<=MAX_OBJECT_SIZE) {
+        /* a byte range of an object that fits: all of it is fetched
+         for the cache, and only the range sent */
+        fill.sent=range.from;
+        ok=(rio_writen(client_fd,range.hdr,range.hdr_len)>=0 &&
+            relay_range(&rio,resp.content_length,client_fd,&fill,
+                        range.to)==0);
+    }
+    else if (ok) {
+        if ((resp.status>=100 && resp.status<200) ||
+            resp.status==204 || resp.status==304) {
+            /* no body */
+        }
+        else if (resp.chunked) {
+            ok=(forward_chunked(&rio,client_fd,&fill)==0);
+        }
+        else if (resp.content_length>=0) {
+            /* known not to fit: pass it straight through */
+            if (fill.obj_length+resp.content_length>MAX_OBJECT_SIZE) {
+                fill.discard=1;
+            }
+            ok=(relay_body(&rio,resp.content_length,client_fd,&fill)==0);
+        }
+        else {
+            /* body ends when the server closes */
+            resp.keepalive=0;
+            framed=0;
+            ok=(relay_body(&rio,-1,client_fd,&fill)==0);
+        }
+    }
+    if (ok) {
+        ok=(flush_fill(client_fd,&fill)==0);
+    }
     
-    /* if object is in the cache, send it to client directly */
-    struct cached_elem *cached_elem;
-    if ((cached_elem=fetch_element(&req_head))) {
-        rio_writen(fd,cached_elem->object,cached_elem->obj_length);
-        return;
+    if (ok && resp.keepalive && rio.rio_cnt==0) {
+        pool_put(req_head->hostname,req_head->port,proxy_clientfd);
+    }
+    else {
+        Close(proxy_clientfd);
+    }
+    if (ok && fill.discard==0 &&
+        parse_cache_meta(fill.object,fill.obj_length,&meta)) {
+        insert_response(req_head,fill.object,fill.obj_length,framed,&meta);
     }
-    /* if object is not in the cache, forward request to web server */
-    sendreq(req_head,request,fd);
+    rio_freeb(&rio);
+    Free(fill.object);
+    if (fill.scratch) {
+        Free(fill.scratch);
+    }
+    return ok && framed;
 }
 
-/* do with a clent's request */
-void serve(int fd)
+/* build the request that goes to the web server: the client's
+ method, the uri, and its Host header (or one made from the tag),
+ then the proxy's own fixed headers, and validators for a stale
+ cached copy. gzip is asked for only if the client takes it; what
+ comes back plain is gzipped when it is cached. keepalive asks the
+ server to keep the connection open for reuse. the pieces point into buf, which holds the client's
+ request, and into tag and stale, which must outlive the send */
+void build_request(rio_iov_t *out, char *buf, struct http_request *req,
+                   request_info *tag, int keepalive,
+                   struct cached_elem *stale)
 {
-    char method[MAXLINE],url[MAXLINE],version[MAXLINE];
-    char buf[MAXLINE],hostname[MAXLINE],uri[MAXLINE];
-    char request[MAXLINE];
+    struct http_span *host=http_header_value(req,buf,"Host");
     
-    int port=80;
-    rio_t rio;
-    request_info req_head={"",port,""};
+    rio_iovinit(out);
+    rio_iovadd(out,buf+req->method.off,req->method.len);
+    rio_iovputs(out," ");
+    rio_iovputs(out,tag->uri);
+    rio_iovputs(out,keepalive ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n");
+    rio_iovputs(out,"Host: ");
+    if (host) {
+        rio_iovadd(out,buf+host->off,host->len);
+    }
+    else {
+        rio_iovputs(out,tag->hostname);
+    }
+    rio_iovputs(out,"\r\n");
     
+    rio_iovputs(out,(char *)user_agent_hdr);
+    rio_iovputs(out,(char *)accept_hdr);
+    rio_iovputs(out,accepts_gzip(buf,req) ? (char *)accept_encoding_hdr
+                                          : (char *)identity_hdr);
+    if (keepalive) {
+        rio_iovputs(out,"Connection: keep-alive\r\n"
+                      "Proxy-Connection: keep-alive\r\n");
+    }
+    else {
+        rio_iovputs(out,"Connection: close\r\n"
+                      "Proxy-Connection: close\r\n");
+    }
+    if (stale) {
+        add_validators(out,stale);
+    }
+    rio_iovputs(out,"\r\n");
+}
+
+/* send a cached object to the client and unpin it.
+ the element stays pinned until the write is done, so a
+ concurrent eviction cannot free it underneath us */
+static int serve_cached(int fd, struct cached_elem *cached_elem,
+                        int keepalive, char *buf, struct http_request *req)
+{
+    int rc=write_cached(fd,cached_elem->object,cached_elem->obj_length,
+                        cached_elem->framed,&cached_elem->meta,buf,req);
+    stats_count(STAT_HITS,1);
+    stats_count(STAT_BYTES_HIT,cached_elem->obj_length);
+    keepalive=keepalive && rc>0;
+    release_element(cached_elem);
+    return keepalive;
+}
 
-    /* read in a request from client */
-    Rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf,MAXLINE);
-    /* change buffer into string*/
-    sscanf(buf,"%s %s %s",method,url,version);
+/* look the object up in the memory cache. a chunked copy is left
+ alone for an HTTP/1.0 client, which would not understand it; the
+ object is fetched again for it, and comes back unchunked */
+static struct cached_elem *fetch_sendable(request_info *req_head, int http10)
+{
+    struct cached_elem *cached_elem=fetch_element(req_head);
     
-    if(strcasecmp(method,"GET"))
-    {
-        printf("want something other than GET\n");
-        clienterror(fd,method,"501","request not implemented",
-                    "none");
-        return;
+    if (cached_elem && http10 && cached_elem->meta.chunked) {
+        release_element(cached_elem);
+        return NULL;
+    }
+    return cached_elem;
+}
+
+/* serve one parsed request, from the cache or the web server.
+ buf holds the request text req was parsed from.
+ keepalive says whether the client wants its connection kept open;
+ returns 1 if it can be */
+int serve_help(request_info *req_head, int fd, char *buf,
+               struct http_request *req, int keepalive)
+{
+    char value[MAXLINE];
+    int i, rc;
+    int http10=!http_span_is(buf,&req->version,"HTTP/1.1");
+    
+    /* Connection and Proxy-Connection may override the default */
+    for (i=0; i<req->nheaders; i++) {
+        struct http_header *h=&req->headers[i];
+        if (http_span_is(buf,&h->name,"Connection") ||
+            http_span_is(buf,&h->name,"Proxy-Connection")) {
+            http_span_copy(buf,&h->value,value,sizeof(value));
+            if (has_word(value,"close")) {
+                keepalive=0;
+            }
+            else if (has_word(value,"keep-alive")) {
+                keepalive=1;
+            }
+        }
     }
-    /* get hostname, port and uri from url */
+    
+    /* look in memory, then in the disk tier */
+    struct l2_hit l2hit;
+    struct cache_meta meta;
+    long start=stats_now();
+    struct cached_elem *cached_elem=fetch_sendable(req_head,http10);
+    int in_l2=(!cached_elem && l2_get(req_head,&l2hit));
+    stats_time(STAGE_LOOKUP,start);
+    
+    /* if a fresh copy of the object is in the cache, send it to
+     client directly */
+    if (cached_elem && cache_fresh(cached_elem)) {
+        return serve_cached(fd,cached_elem,keepalive,buf,req);
+    }
+    /* a disk tier hit is written straight from the mapped segment,
+     then brought back into memory. a stale one is only brought back,
+     to be revalidated below */
+    if (in_l2) {
+        if (!parse_cache_meta(l2hit.object,l2hit.obj_length,&meta)) {
+            l2_release(&l2hit);
+        }
+        else if (time(NULL)<meta.expires && !(http10 && meta.chunked)) {
+            rc=write_cached(fd,l2hit.object,l2hit.obj_length,l2hit.framed,
+                            &meta,buf,req);
+            stats_count(STAT_L2_HITS,1);
+            stats_count(STAT_BYTES_HIT,l2hit.obj_length);
+            insert_element(req_head,l2hit.object,l2hit.obj_length,
+                           l2hit.framed,&meta);
+            keepalive=keepalive && rc>0;
+            l2_release(&l2hit);
+            return keepalive;
+        }
+        else {
+            insert_element(req_head,l2hit.object,l2hit.obj_length,
+                           l2hit.framed,&meta);
+            l2_release(&l2hit);
+            cached_elem=fetch_sendable(req_head,http10);
+        }
+    }
+    
+    /* if another thread is already fetching or revalidating the
+     object, wait for it and take the result from the cache. if that
+     did not leave a fresh copy, go to the server ourselves */
+    if (cached_elem) {
+        release_element(cached_elem);
+    }
+    struct flight *flight=flight_begin(req_head);
+    if ((cached_elem=fetch_sendable(req_head,http10)) &&
+        cache_fresh(cached_elem)) {
+        if (flight) {
+            flight_end(flight);
+        }
+        return serve_cached(fd,cached_elem,keepalive,buf,req);
+    }
+    
+    /* a stale copy with a validator is revalidated rather than
+     fetched again */
+    if (cached_elem && !can_revalidate(cached_elem)) {
+        release_element(cached_elem);
+        cached_elem=NULL;
+    }
+    stats_count(STAT_MISSES,1);
+    keepalive=sendreq(req_head,buf,req,fd,cached_elem,&flight) && keepalive;
+    if (cached_elem) {
+        release_element(cached_elem);
+    }
+    if (flight) {
+        flight_end(flight);
+    }
+    return keepalive;
+}
+
+/* get hostname, port and uri from url */
+void parse_url(char *url, char *hostname, char *uri, int *port)
+{
+    strcpy(hostname,"");
+    strcpy(uri,"/");
     if (strstr(url,"http")) {
         char *ptr=strchr(url,'/');
         char *uri_orig=strchr(ptr+2,'/');
@@ -189,66 +800,306 @@ void serve(int fd)
         if (port_orig) {
             *port_orig='\0';
             port_orig ++;
-            port=atoi(port_orig);
+            *port=atoi(port_orig);
         }
         strcpy(hostname,ptr);
         
     }
+}
+
+/* do with one of a clent's requests.
+ the header block is parsed in place in the rio buffer, a line at a
+ time as it arrives, and stays there while the request is served.
+ returns 1 if the connection can carry another request */
+int serve_request(int fd, rio_t *rp)
+{
+    char method[16],url[MAXLINE];
+    struct http_request req;
+    request_info req_head;
+    ssize_t n;
+    int rc,keepalive;
+    long start;
+    
+    /* read in a request from client. nothing arriving within the
+     idle timeout ends the connection. while it waits the connection
+     holds no buffer */
+    if (rio_waitb(rp)<=0) {
+        return 0;
+    }
+    start=stats_now();
+    http_request_init(&req);
+    while ((rc=http_parse_request(&req,rp->rio_bufptr,rp->rio_cnt))==
+           HTTP_AGAIN) {
+        if ((n=rio_fill(rp))<=0) {
+            if (n<0 && errno==ENOBUFS) {
+                clienterror(fd,"header","431",
+                            "Request Header Fields Too Large",
+                            "request header too long");
+            }
+            return 0;
+        }
+    }
+    if (rc==HTTP_ERROR) {
+        clienterror(fd,"request","400","bad request",
+                    "malformed request header");
+        return 0;
+    }
+    char *buf=rp->rio_bufptr;
+    stats_time(STAGE_PARSE,start);
+    stats_count(STAT_REQUESTS,1);
+    
+    if(!http_span_is(buf,&req.method,"GET"))
+    {
+        http_span_copy(buf,&req.method,method,sizeof(method));
+        printf("want something other than GET\n");
+        clienterror(fd,method,"501","request not implemented",
+                    "none");
+        return 0;
+    }
+    if (http_span_copy(buf,&req.url,url,MAXLINE)>=MAXLINE) {
+        clienterror(fd,"url","414","URI Too Long","url too long");
+        return 0;
+    }
+    if (!strcmp(url,STATS_PATH)) {
+        serve_stats(fd);
+        return 0;
+    }
+    req_head.port=80;
+    parse_url(url,req_head.hostname,req_head.uri,&req_head.port);
     
-    serve_help(hostname,uri,req_head,fd,port,request,method,rio);
+    /* HTTP/1.1 clients keep the connection unless they say otherwise */
+    start=stats_now();
+    keepalive=serve_help(&req_head,fd,buf,&req,
+                         http_span_is(buf,&req.version,"HTTP/1.1"));
+    stats_time(STAGE_TOTAL,start);
+    rio_consume(rp,req.len);
+    return keepalive;
+}
 
+/* do with a clent's connection: serve its requests in order,
+ including pipelined ones already sitting in the rio buffer */
+void serve(int fd)
+{
+    rio_t rio;
+    struct timeval tv;
+
+    tv.tv_sec=CLIENT_IDLE_TIMEOUT;
+    tv.tv_usec=0;
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+
+    rio_readinitsz(&rio,fd,RIO_BUFSIZE,MAX_REQUEST_HEADER);
+    while (serve_request(fd,&rio)) {
+        ;
+    }
+    rio_freeb(&rio);
 }
 
 
+/* a connection handed to its own thread, with when it was accepted */
+struct accepted {
+    int fd;
+    long when;
+};
+
 /* handle a single transaction */
 void *thread(void *arg)
 {
-    int connfd=*((int *)arg);
+    struct accepted *a=(struct accepted *)arg;
+    int connfd=a->fd;
     Pthread_detach(Pthread_self());
+    stats_time(STAGE_ACCEPT,a->when);
     Free(arg);
     serve(connfd);
     Close(connfd);
     return NULL;
 }
 
+/* connection queue shared by the prethreaded workers */
+static sbuf_t sbuf;
+
+/* prethreaded worker: serve connections taken off the queue */
+void *worker(void *arg)
+{
+    long when;
+    Pthread_detach(Pthread_self());
+    while (1) {
+        int connfd = sbuf_remove(&sbuf, &when);
+        stats_time(STAGE_ACCEPT, when);
+        serve(connfd);
+        Close(connfd);
+    }
+    return NULL;
+}
+
+/* accept connections for ever, handing them to the prethreaded
+ workers if there are any or else to a thread each */
+static void accept_loop(int listenfd, int pooled)
+{
+    int clientlen, connfd;
+    struct accepted *connp;
+    struct sockaddr_in clientaddr;
+    pthread_t tid;
+
+    while (1) {
+        clientlen=sizeof(clientaddr);
+        connfd=Accept(listenfd, (SA *)&clientaddr,(socklen_t *)&clientlen);
+        stats_count(STAT_CONNS,1);
+        if (pooled) {
+            sbuf_insert(&sbuf, connfd, stats_now());
+            continue;
+        }
+        connp= Calloc(1,sizeof(struct accepted));
+        connp->fd=connfd;
+        connp->when=stats_now();
+        Pthread_create(&tid,NULL,thread,connp);
+    }
+}
+
+/* one acceptor per core, each with its own listening socket */
+struct acceptor {
+    int listenfd;
+    int cpu;
+    int evmode;
+    int pooled;
+};
+
+/* pin to the acceptor's core and accept there, with an event loop
+ of its own in event-driven mode. threads it starts for connections
+ inherit the core */
+void *acceptor(void *arg)
+{
+    struct acceptor *a=(struct acceptor *)arg;
+
+    if (pin_to_cpu(a->cpu) < 0) {
+        fprintf(stderr,"acceptor %d: could not pin to a cpu\n",a->cpu);
+    }
+    if (a->evmode) {
+        run_event_loop(a->listenfd);
+    }
+    accept_loop(a->listenfd,a->pooled);
+    return NULL;
+}
+
 
 void terminate(int sig){
     puts("Proxy ignores SIGPIPE \n");
 }
 
+void usage(char *prog)
+{
+    fprintf(stderr,"usage: %s [-e] [-s shards] [-p lru|slru|tinylfu] "
+            "[-d l2dir] [-H hostsfile] [-t threads [-q queue]] [-c cores] "
+            "<port>\n",
+            prog);
+    exit(1);
+}
+
 int main(int argc, char **argv)
 {
     printf("start proxy information\n");
     printf("%s%s%s", user_agent_hdr, accept_hdr, accept_encoding_hdr);
     printf("end proxy information\n");
     
-    int listenfd, *connfdp, port, clientlen;
-    struct sockaddr_in clientaddr;
+    int listenfd, port;
     pthread_t tid;
+    int opt, shards=1, evmode=0, nthreads=0, qdepth=0, ncores=-1, i;
+    struct acceptor *acceptors;
+    char *policy="lru", *l2dir=NULL, *hostsfile=NULL;
     
     
     Signal(SIGPIPE, terminate);
     
-    /* cache initialization */
-    init_cache();
-    
     /* check cmd line args */
-    if (argc != 2) {
-        fprintf(stderr,"usage: %s <port>\n", argv[0]);
-        exit(1);
+    while ((opt = getopt(argc, argv, "es:p:d:H:t:q:c:")) != -1) {
+        switch (opt) {
+            case 'e':
+                evmode = 1;
+                break;
+            case 's':
+                shards = atoi(optarg);
+                break;
+            case 'p':
+                if (!find_policy(optarg)) {
+                    usage(argv[0]);
+                }
+                policy = optarg;
+                break;
+            case 'd':
+                l2dir = optarg;
+                break;
+            case 'H':
+                hostsfile = optarg;
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'q':
+                qdepth = atoi(optarg);
+                break;
+            case 'c':
+                ncores = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc-1) {
+        usage(argv[0]);
+    }
+    
+    /* cache initialization */
+    init_cache(shards,policy);
+    if (l2dir) {
+        init_l2(l2dir);
+    }
+    init_pool();
+    init_dns(hostsfile);
+    init_flights();
+    init_stats();
+
+    port=atoi(argv[optind]);
+
+    /* prethreaded mode: a fixed pool of workers fed through a bounded
+     queue. when the queue is full the accept loop blocks, so excess
+     clients wait in the listen backlog instead of spawning threads */
+    if (nthreads > 0 && !evmode) {
+        if (qdepth <= 0) {
+            qdepth = nthreads;
+        }
+        sbuf_init(&sbuf, qdepth);
+        for (i = 0; i < nthreads; i++) {
+            Pthread_create(&tid, NULL, worker, NULL);
+        }
+    }
+
+    /* per-core mode: an acceptor pinned to each core, every one with
+     its own SO_REUSEPORT listener so the kernel spreads connections
+     across them. -c 0 takes every core we may run on */
+    if (ncores >= 0) {
+        if (ncores == 0) {
+            ncores = usable_cpus();
+        }
+        acceptors = Calloc(ncores, sizeof(struct acceptor));
+        for (i = 0; i < ncores; i++) {
+            acceptors[i].listenfd = Open_reuseport_listenfd(port);
+            acceptors[i].cpu = i;
+            acceptors[i].evmode = evmode;
+            acceptors[i].pooled = nthreads > 0 && !evmode;
+        }
+        for (i = 1; i < ncores; i++) {
+            Pthread_create(&tid, NULL, acceptor, &acceptors[i]);
+        }
+        acceptor(&acceptors[0]);
     }
 
     /* initialize listening port */
-    port=atoi(argv[1]);
     listenfd = Open_listenfd(port);
 
-    while (1) {
-        clientlen=sizeof(clientaddr);
-        connfdp= Calloc(1,sizeof(int));
-        *connfdp=Accept(listenfd, (SA *)&clientaddr,(socklen_t *)&clientlen);
-        Pthread_create(&tid,NULL,thread,connfdp);
-        
+    /* event-driven mode: one thread, epoll */
+    if (evmode) {
+        run_event_loop(listenfd);
     }
+    accept_loop(listenfd, nthreads > 0);
     
     return 0;
 }
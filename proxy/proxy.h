@@ -0,0 +1,41 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "cache.h"
+#include "httpparse.h"
+
+/* Seconds a client connection may sit idle between requests */
+#define CLIENT_IDLE_TIMEOUT 15
+
+/* Seconds an event loop connection may go without any progress */
+#define CONN_STALL_TIMEOUT 30
+
+/* Largest block moved per read/write when relaying a body */
+#define RELAY_BLOCK 65536
+
+/* Largest request header block accepted; bigger ones get a 431 */
+#define MAX_REQUEST_HEADER 32768
+
+/* Shared request helpers in proxy.c */
+size_t error_response(char *buf, size_t size, char *cause, char *num,
+                      char *s_message, char *l_message);
+void clienterror(int fd, char *cause, char *num,
+                 char *s_message, char *l_message);
+void parse_url(char *url, char *hostname, char *uri, int *port);
+size_t stats_response(char *buf, size_t size);
+void serve_stats(int fd);
+void build_request(rio_iov_t *out, char *buf, struct http_request *req,
+                   request_info *tag, int keepalive,
+                   struct cached_elem *stale);
+
+/* Zero-copy forwarding in zcopy.c */
+long splice_relay(int in, int out, long len);
+
+/* CPU affinity in affinity.c */
+int usable_cpus();
+int pin_to_cpu(int i);
+
+/* Event-driven front end in evloop.c */
+void run_event_loop(int listenfd);
+
+#endif /* __PROXY_H__ */
@@ -0,0 +1,630 @@
+/*
+   proxybench - load test the proxy against a local origin server and
+   report throughput, latency percentiles, hit ratio and the proxy's
+   CPU time and syscalls per request.
+
+   usage: proxybench [-c clients] [-d seconds] [-w warmup] [-r rate]
+                     [-n objects] [-z zipf] [-s sizes] [-S seed] [-k]
+                     [-p port] [proxy command ...]
+
+   an origin server runs in this process on a free port and serves
+   objects /obj/0 .. /obj/<objects-1>. object i has a fixed size drawn
+   from the -s distribution and is asked for with Zipf popularity of
+   exponent -z, object 0 the most popular, so a run is the same
+   workload every time for the same seed.
+
+   -s is one of
+       fixed:N           every object N bytes
+       uniform:LO:HI     between LO and HI bytes
+       pareto:LO:ALPHA   heavy tailed, at least LO bytes
+
+   the clients are -c threads. without -r each sends its next request
+   as soon as the last one is answered (closed loop); with -r they
+   send rate requests per second between them at random, Poisson
+   arrival times (open loop), and latency counts from when a request
+   was due, so a proxy that falls behind is not flattered by it.
+   -k keeps client connections open between requests.
+
+   besides the time to the whole response, the time to its first
+   byte is reported. without -k every request opens its connection,
+   so that figure runs from connect, through the proxy's accept and
+   hand-off to a thread, to the status line coming back.
+
+   the proxy command, if given, is started with the port appended and
+   killed at the end; its CPU time and read/write syscalls over the
+   measured interval come from /proc. without a command a proxy already
+   listening on -p is measured, without those two figures. the hit
+   ratio is the share of requests that never reached the origin.
+
+   example: proxybench -c 32 -d 10 ./proxy -e
+
+   build: gcc -O2 -o proxybench proxybench.c csapp.c -lpthread -lm
+ */
+
+#include "csapp.h"
+#include <math.h>
+#include <getopt.h>
+
+#define BENCH_MAX_OBJECT (1L<<30)   /* largest object the origin serves */
+#define BENCH_PORT 18081            /* default proxy port */
+
+/* one client thread */
+struct client{
+    pthread_t tid;
+    unsigned short seed[3];
+    int fd;                         /* kept-alive connection, or -1 */
+    rio_t rio;
+    long *lat;                      /* latencies in microseconds */
+    long *first;                    /* of those, to the first byte */
+    size_t nlat, cap;
+    long errors;
+    double bytes;
+};
+
+/* Global variables */
+static int nobjects=1000, proxy_port=BENCH_PORT, origin_port, keepalive=0;
+static double rate=0;               /* requests per second, 0 closed loop */
+static int nclients=16;
+static size_t *obj_size;
+static double *popularity;          /* cumulative Zipf distribution */
+static char *payload;
+static volatile int measuring=0, stopping=0;
+static long origin_requests=0, origin_bytes=0;
+
+/* a monotonic clock in microseconds */
+static long now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000L + ts.tv_nsec/1000;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-c clients] [-d seconds] [-w warmup] "
+            "[-r rate] [-n objects] [-z zipf] [-s sizes] [-S seed] [-k] "
+            "[-p port] [proxy command ...]\n", prog);
+    exit(1);
+}
+
+/* the size of every object, from a distribution spec */
+static int make_sizes(char *spec, unsigned short *seed)
+{
+    double lo, hi = 0, alpha = 0, v;
+    int i, kind;
+
+    if (sscanf(spec, "fixed:%lf", &lo) == 1) {
+        kind = 'f';
+    }
+    else if (sscanf(spec, "uniform:%lf:%lf", &lo, &hi) == 2 && hi >= lo) {
+        kind = 'u';
+    }
+    else if (sscanf(spec, "pareto:%lf:%lf", &lo, &alpha) == 2 && alpha > 0) {
+        kind = 'p';
+    }
+    else {
+        return 0;
+    }
+
+    obj_size = (size_t *)Malloc(nobjects * sizeof(size_t));
+    for (i = 0; i < nobjects; i++) {
+        if (kind == 'f') {
+            v = lo;
+        }
+        else if (kind == 'u') {
+            v = lo + erand48(seed)*(hi - lo);
+        }
+        else {
+            v = lo / pow(1.0 - erand48(seed), 1.0/alpha);
+        }
+        if (v < 0) {
+            v = 0;
+        }
+        obj_size[i] = v < BENCH_MAX_OBJECT ? (size_t)v : BENCH_MAX_OBJECT;
+    }
+    return 1;
+}
+
+/* cumulative Zipf popularity with exponent s; s = 0 is uniform */
+static void make_popularity(double s)
+{
+    double sum = 0;
+    int i;
+
+    popularity = (double *)Malloc(nobjects * sizeof(double));
+    for (i = 0; i < nobjects; i++) {
+        sum += 1.0 / pow(i+1, s);
+        popularity[i] = sum;
+    }
+    for (i = 0; i < nobjects; i++) {
+        popularity[i] /= sum;
+    }
+}
+
+/* draw an object by popularity */
+static int pick_object(unsigned short *seed)
+{
+    double u = erand48(seed);
+    int lo = 0, hi = nobjects-1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (popularity[mid] < u) {
+            lo = mid+1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* does a Connection header line say close? */
+static int says_close(char *line)
+{
+    char *p;
+
+    for (p = line; *p; p++) {
+        if (!strncasecmp(p, "close", 5)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * origin server
+ */
+
+/* answer requests on one connection until it is closed */
+static void *origin_conn(void *vargp)
+{
+    int fd = *(int *)vargp, id, minor, keep;
+    char line[MAXLINE], hdr[MAXLINE];
+    rio_t rio;
+    rio_iov_t out;
+    ssize_t n;
+
+    Pthread_detach(pthread_self());
+    Free(vargp);
+    rio_readinitb(&rio, fd);
+    while ((n = rio_readlineb(&rio, line, MAXLINE)) > 0) {
+        if (sscanf(line, "GET /obj/%d HTTP/1.%d", &id, &minor) != 2) {
+            id = -1;
+            minor = 0;
+        }
+        keep = minor >= 1;
+        while ((n = rio_readlineb(&rio, line, MAXLINE)) > 0 &&
+               strcmp(line, "\r\n") && strcmp(line, "\n")) {
+            if (!strncasecmp(line, "Connection:", 11)) {
+                keep = !says_close(line);
+            }
+        }
+        if (n <= 0) {
+            break;
+        }
+
+        rio_iovinit(&out);
+        if (id < 0 || id >= nobjects) {
+            sprintf(hdr, "HTTP/1.%d 404 Not Found\r\n"
+                    "Content-Length: 0\r\n\r\n", minor);
+            rio_iovputs(&out, hdr);
+        }
+        else {
+            sprintf(hdr, "HTTP/1.%d 200 OK\r\nContent-Type: "
+                    "application/octet-stream\r\nContent-Length: %zu\r\n"
+                    "Cache-Control: max-age=86400\r\n%s\r\n", minor,
+                    obj_size[id], keep ? "" : "Connection: close\r\n");
+            rio_iovputs(&out, hdr);
+            rio_iovadd(&out, payload, obj_size[id]);
+            __sync_fetch_and_add(&origin_requests, 1);
+            __sync_fetch_and_add(&origin_bytes, obj_size[id]);
+        }
+        if (rio_writev(fd, &out) < 0 || !keep) {
+            break;
+        }
+    }
+    rio_freeb(&rio);
+    Close(fd);
+    return NULL;
+}
+
+static void *origin(void *vargp)
+{
+    int listenfd = *(int *)vargp, *connp;
+    pthread_t tid;
+
+    while (1) {
+        connp = (int *)Malloc(sizeof(int));
+        *connp = Accept(listenfd, NULL, NULL);
+        Pthread_create(&tid, NULL, origin_conn, connp);
+    }
+    return NULL;
+}
+
+/*
+ * clients
+ */
+
+/* connect to the proxy, -1 on error */
+static int proxy_connect()
+{
+    struct sockaddr_in addr;
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(proxy_port);
+    if (connect(fd, (SA *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void drop_conn(struct client *c)
+{
+    if (c->fd >= 0) {
+        rio_freeb(&c->rio);
+        Close(c->fd);
+        c->fd = -1;
+    }
+}
+
+/* fetch one object through the proxy, setting *first when the
+ status line is in. returns the bytes of body received, or -1
+ unless the whole object came back */
+static long fetch(struct client *c, int id, long *first)
+{
+    char req[MAXLINE], line[MAXLINE], sink[MAXBUF];
+    long length = -1, got = 0;
+    int status = 0, close_after = !keepalive, reused = c->fd >= 0;
+    ssize_t n;
+
+    if (c->fd < 0) {
+        if ((c->fd = proxy_connect()) < 0) {
+            return -1;
+        }
+        rio_readinitb(&c->rio, c->fd);
+    }
+    sprintf(req, "GET http://127.0.0.1:%d/obj/%d HTTP/1.%d\r\n"
+            "Host: 127.0.0.1:%d\r\n%s\r\n", origin_port, id,
+            keepalive, origin_port, keepalive ? "" : "Connection: close\r\n");
+    if (rio_writen(c->fd, req, strlen(req)) < 0 ||
+        (n = rio_readlineb(&c->rio, line, MAXLINE)) <= 0) {
+        drop_conn(c);
+        /* a kept-alive connection the proxy had closed; try afresh */
+        return reused ? fetch(c, id, first) : -1;
+    }
+    *first = now_us();
+    sscanf(line, "HTTP/1.%*d %d", &status);
+    while ((n = rio_readlineb(&c->rio, line, MAXLINE)) > 0 &&
+           strcmp(line, "\r\n") && strcmp(line, "\n")) {
+        if (!strncasecmp(line, "Content-Length:", 15)) {
+            length = atol(line+15);
+        }
+        else if (!strncasecmp(line, "Connection:", 11) &&
+                 says_close(line)) {
+            close_after = 1;
+        }
+    }
+    if (n <= 0) {
+        drop_conn(c);
+        return -1;
+    }
+
+    /* the body, up to its length or the end of the connection */
+    while (length < 0 || got < length) {
+        size_t want = sizeof(sink);
+        if (length >= 0 && (size_t)(length - got) < want) {
+            want = length - got;
+        }
+        if ((n = rio_readnb(&c->rio, sink, want)) <= 0) {
+            break;
+        }
+        got += n;
+    }
+    if (length < 0 || got < length) {
+        close_after = 1;
+    }
+    if (close_after) {
+        drop_conn(c);
+    }
+    return status == 200 && (size_t)got == obj_size[id] ? got : -1;
+}
+
+/* keep a latency sample and its time to first byte */
+static void record(struct client *c, long lat, long first)
+{
+    if (c->nlat == c->cap) {
+        c->cap = c->cap ? 2*c->cap : 4096;
+        c->lat = (long *)Realloc(c->lat, c->cap * sizeof(long));
+        c->first = (long *)Realloc(c->first, c->cap * sizeof(long));
+    }
+    c->lat[c->nlat] = lat;
+    c->first[c->nlat++] = first;
+}
+
+static void *client(void *vargp)
+{
+    struct client *c = (struct client *)vargp;
+    long due = now_us(), start, end, first, got;
+    int counted;
+
+    while (!stopping) {
+        /* open loop: wait for the next arrival, however late we are */
+        if (rate > 0) {
+            due += (long)(-log(1.0 - erand48(c->seed)) * nclients / rate *
+                          1e6);
+            while ((start = now_us()) < due && !stopping) {
+                usleep(due - start < 100000 ? due - start : 100000);
+            }
+            start = due;
+        }
+        else {
+            start = now_us();
+        }
+        if (stopping) {
+            break;
+        }
+        counted = measuring;
+        if ((got = fetch(c, pick_object(c->seed), &first)) < 0) {
+            c->errors += counted;
+            continue;
+        }
+        end = now_us();
+        if (counted) {
+            record(c, end - start, first - start);
+            c->bytes += got;
+        }
+    }
+    drop_conn(c);
+    return NULL;
+}
+
+/*
+ * the proxy process
+ */
+
+/* CPU ticks and read/write syscalls of a process so far */
+static void proc_usage(pid_t pid, long *ticks, long *syscalls)
+{
+    char path[64], line[MAXLINE], *p;
+    unsigned long utime, stime;
+    long v;
+    FILE *fp;
+
+    *ticks = *syscalls = 0;
+    sprintf(path, "/proc/%d/stat", (int)pid);
+    if ((fp = fopen(path, "r")) != NULL) {
+        /* the fields after the command name, which may hold spaces */
+        if (fgets(line, sizeof(line), fp) && (p = strrchr(line, ')')) &&
+            sscanf(p+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                   "%lu %lu", &utime, &stime) == 2) {
+            *ticks = utime + stime;
+        }
+        fclose(fp);
+    }
+    sprintf(path, "/proc/%d/io", (int)pid);
+    if ((fp = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "syscr: %ld", &v) == 1 ||
+                sscanf(line, "syscw: %ld", &v) == 1) {
+                *syscalls += v;
+            }
+        }
+        fclose(fp);
+    }
+}
+
+/* start the proxy on proxy_port and wait until it accepts */
+static pid_t start_proxy(char **cmd, int ncmd)
+{
+    char **args = (char **)Calloc(ncmd + 2, sizeof(char *));
+    char port[16];
+    pid_t pid;
+    int i, fd;
+
+    sprintf(port, "%d", proxy_port);
+    for (i = 0; i < ncmd; i++) {
+        args[i] = cmd[i];
+    }
+    args[ncmd] = port;
+    if ((pid = Fork()) == 0) {
+        fd = Open("/dev/null", O_WRONLY, 0);
+        Dup2(fd, STDOUT_FILENO);
+        execvp(args[0], args);
+        unix_error("execvp error");
+    }
+    Free(args);
+    for (i = 0; i < 200; i++) {
+        if ((fd = proxy_connect()) >= 0) {
+            Close(fd);
+            return pid;
+        }
+        usleep(10000);
+    }
+    kill(pid, SIGTERM);
+    app_error("proxy did not start");
+    return -1;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+    int opt, i, listenfd;
+    double duration = 10, warmup = 2, zipf = 0.9;
+    char *sizes = "pareto:1024:1.5";
+    unsigned short seed[3] = { 1, 2, 3 };
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    struct client *clients;
+    pthread_t tid;
+    pid_t pid = 0;
+    long t0, t1, ticks0, ticks1, sys0, sys1, req0, req1, bytes0, bytes1;
+    long *lat, *first, errors = 0;
+    size_t nlat = 0, k, payload_size = 0;
+    double bytes = 0, secs;
+
+    /* options stop at the proxy command, whose own options follow */
+    while ((opt = getopt(argc, argv, "+c:d:w:r:n:z:s:S:kp:")) != -1) {
+        switch (opt) {
+            case 'c':
+                nclients = atoi(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'w':
+                warmup = atof(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'n':
+                nobjects = atoi(optarg);
+                break;
+            case 'z':
+                zipf = atof(optarg);
+                break;
+            case 's':
+                sizes = optarg;
+                break;
+            case 'S':
+                seed[0] = atoi(optarg);
+                break;
+            case 'k':
+                keepalive = 1;
+                break;
+            case 'p':
+                proxy_port = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (nclients < 1 || nobjects < 1 || duration <= 0 || rate < 0) {
+        usage(argv[0]);
+    }
+    if (!make_sizes(sizes, seed)) {
+        fprintf(stderr, "bad size distribution %s\n", sizes);
+        usage(argv[0]);
+    }
+    make_popularity(zipf);
+    /* every object is a prefix of one payload as long as the largest */
+    for (i = 0; i < nobjects; i++) {
+        if (obj_size[i] > payload_size) {
+            payload_size = obj_size[i];
+        }
+    }
+    payload = (char *)Malloc(payload_size ? payload_size : 1);
+    for (k = 0; k < payload_size; k++) {
+        payload[k] = 'a' + k%26;
+    }
+    Signal(SIGPIPE, SIG_IGN);
+
+    /* the origin, on any free port */
+    listenfd = Open_listenfd(0);
+    if (getsockname(listenfd, (SA *)&addr, &len) < 0) {
+        unix_error("getsockname error");
+    }
+    origin_port = ntohs(addr.sin_port);
+    Pthread_create(&tid, NULL, origin, &listenfd);
+
+    if (optind < argc) {
+        pid = start_proxy(argv + optind, argc - optind);
+    }
+
+    clients = (struct client *)Calloc(nclients, sizeof(struct client));
+    for (i = 0; i < nclients; i++) {
+        clients[i].fd = -1;
+        clients[i].seed[0] = seed[0] + i;
+        clients[i].seed[1] = seed[1] * (i+1);
+        clients[i].seed[2] = seed[2] ^ (i << 4);
+        Pthread_create(&clients[i].tid, NULL, client, &clients[i]);
+    }
+
+    /* warm the cache up, then measure */
+    usleep((useconds_t)(warmup * 1e6));
+    if (pid) {
+        proc_usage(pid, &ticks0, &sys0);
+    }
+    req0 = origin_requests;
+    bytes0 = origin_bytes;
+    t0 = now_us();
+    measuring = 1;
+    usleep((useconds_t)(duration * 1e6));
+    measuring = 0;
+    t1 = now_us();
+    req1 = origin_requests;
+    bytes1 = origin_bytes;
+    if (pid) {
+        proc_usage(pid, &ticks1, &sys1);
+    }
+    stopping = 1;
+    for (i = 0; i < nclients; i++) {
+        Pthread_join(clients[i].tid, NULL);
+        nlat += clients[i].nlat;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+    }
+    if (pid) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+
+    lat = (long *)Malloc((nlat ? nlat : 1) * sizeof(long));
+    first = (long *)Malloc((nlat ? nlat : 1) * sizeof(long));
+    for (i = 0, k = 0; i < nclients; i++) {
+        memcpy(lat + k, clients[i].lat, clients[i].nlat * sizeof(long));
+        memcpy(first + k, clients[i].first, clients[i].nlat * sizeof(long));
+        k += clients[i].nlat;
+        Free(clients[i].lat);
+        Free(clients[i].first);
+    }
+    qsort(lat, nlat, sizeof(long), cmp_long);
+    qsort(first, nlat, sizeof(long), cmp_long);
+    secs = (t1 - t0) / 1e6;
+
+    printf("workload    %s loop, %d clients%s, %d objects, zipf %.2f, "
+           "sizes %s\n", rate > 0 ? "open" : "closed", nclients,
+           keepalive ? " kept alive" : "", nobjects, zipf, sizes);
+    if (rate > 0) {
+        printf("offered     %.1f req/s\n", rate);
+    }
+    printf("requests    %zu in %.1f s, %ld errors\n", nlat, secs, errors);
+    printf("throughput  %.1f req/s, %.2f MB/s\n", nlat / secs,
+           bytes / secs / 1e6);
+    if (nlat > 0) {
+        printf("latency us  p50 %ld  p99 %ld  p99.9 %ld  max %ld\n",
+               lat[nlat/2], lat[(size_t)(nlat*0.99)],
+               lat[(size_t)(nlat*0.999)], lat[nlat-1]);
+        printf("1st byte us p50 %ld  p99 %ld  p99.9 %ld  max %ld\n",
+               first[nlat/2], first[(size_t)(nlat*0.99)],
+               first[(size_t)(nlat*0.999)], first[nlat-1]);
+        printf("hit ratio   %.4f, bytes %.4f\n",
+               1.0 - (double)(req1 - req0) / nlat,
+               bytes > 0 ? 1.0 - (bytes1 - bytes0) / bytes : 0.0);
+    }
+    if (pid && nlat > 0) {
+        printf("proxy cpu   %.1f us/request\n", (ticks1 - ticks0) * 1e6 /
+               sysconf(_SC_CLK_TCK) / nlat);
+        printf("syscalls    %.1f read/write per request\n",
+               (double)(sys1 - sys0) / nlat);
+    }
+
+    Free(lat);
+    Free(first);
+    Free(clients);
+    return errors > 0;
+}
@@ -0,0 +1,156 @@
+/*
+   byte ranges.
+
+   a request with a single "Range: bytes=..." is answered with 206
+   and just that part of the body, taken from a whole 200 response:
+   a cached object, or one still arriving from the web server, which
+   is fetched and cached in full. anything else about the range
+   (several ranges, an If-Range, a response that is not a plain 200
+   with a known length) gets the whole response, as HTTP allows. a
+   range that starts past the end gets 416. a gzipped cached object
+   is always sent whole: the proxy may have gzipped it, and a range
+   of those bytes would not match one taken from the response a miss
+   gets.
+ */
+
+#include "range.h"
+
+/* the single byte range a GET asks for: first-last, first- with
+ last -1, or the last n bytes as first -1, last n. returns 0 if it
+ does not ask for exactly one */
+static int range_of(char *buf, struct http_request *req, long *first,
+                    long *last)
+{
+    struct http_span *v;
+    char value[MAXLINE], *p, *end;
+
+    if (!http_span_is(buf, &req->method, "GET") ||
+        (v = http_header_value(req, buf, "Range")) == NULL ||
+        http_header_value(req, buf, "If-Range") != NULL ||
+        http_span_copy(buf, v, value, sizeof(value)) >= sizeof(value) ||
+        strncasecmp(value, "bytes=", 6) || strchr(value, ',')) {
+        return 0;
+    }
+    p = value + 6;
+    while (*p == ' ') {
+        p++;
+    }
+    if (*p == '-') {
+        *first = -1;
+        *last = strtol(p+1, &end, 10);
+        return end > p+1 && *last >= 0;
+    }
+    *first = strtol(p, &end, 10);
+    if (end == p || *end != '-' || *first < 0) {
+        return 0;
+    }
+    p = end+1;
+    if (*p == '\0' || *p == ' ') {
+        *last = -1;
+        return 1;
+    }
+    *last = strtol(p, &end, 10);
+    return end > p && *last >= *first;
+}
+
+/* does a request ask for a single byte range? */
+int range_asked(char *buf, struct http_request *req)
+{
+    long first, last;
+
+    return range_of(buf, req, &first, &last);
+}
+
+/* work out the answer to a ranged request from the first len bytes
+ of a 200 response, which need only hold its header block. complete
+ says all of the response is there, so a body without a
+ Content-Length ends with it. fills rr and returns RANGE_OK, or
+ RANGE_NONE or RANGE_WAIT */
+int range_reply(char *buf, struct http_request *req, unsigned char *resp,
+                size_t len, int complete, struct range_reply *rr)
+{
+    char *p, *eol, *start = (char *)resp, *end = (char *)resp + len;
+    char tail[MAXLINE];
+    long first, last, length = -1;
+    int minor, status;
+    size_t body_off = 0, n, tail_len;
+
+    if (!range_of(buf, req, &first, &last)) {
+        return RANGE_NONE;
+    }
+
+    /* the status line, then the headers up to the blank line */
+    if ((status = http_status_line(start, len, &minor)) == 0) {
+        return RANGE_WAIT;
+    }
+    if (status != 200) {
+        return RANGE_NONE;
+    }
+    for (p = memchr(start, '\n', len) + 1; p < end; p = eol+1) {
+        if ((eol = memchr(p, '\n', end - p)) == NULL) {
+            break;
+        }
+        if (*p == '\r' || *p == '\n') {
+            body_off = eol+1 - start;
+            break;
+        }
+        if (http_line_is(p, eol, "Transfer-Encoding") ||
+            http_line_is(p, eol, "Content-Range")) {
+            return RANGE_NONE;
+        }
+        if (http_line_is(p, eol, "Content-Length")) {
+            length = atol(p + 15);
+        }
+    }
+    if (body_off == 0) {
+        return RANGE_WAIT;
+    }
+    if (length < 0) {
+        if (!complete) {
+            return RANGE_NONE;
+        }
+        length = len - body_off;
+    }
+    rr->total = body_off + length;
+
+    /* the bytes the range covers, if any */
+    if (first < 0) {
+        first = last < length ? length - last : 0;
+        last = length - 1;
+    }
+    else if (last < 0 || last >= length) {
+        last = length - 1;
+    }
+    if (first >= length || first > last) {
+        rr->hdr_len = sprintf(rr->hdr, "HTTP/1.%d 416 Range Not Satisfiable"
+                              "\r\nContent-Range: bytes */%ld\r\n"
+                              "Content-Length: 0\r\n\r\n", minor, length);
+        rr->from = rr->to = 0;
+        return RANGE_OK;
+    }
+
+    /* the 200 header block less its length, as a 206 */
+    tail_len = sprintf(tail, "Content-Range: bytes %ld-%ld/%ld\r\n"
+                       "Content-Length: %ld\r\n\r\n", first, last, length,
+                       last - first + 1);
+    rr->hdr_len = sprintf(rr->hdr, "HTTP/1.%d 206 Partial Content\r\n",
+                          minor);
+    for (p = memchr(start, '\n', body_off) + 1; p < start + body_off;
+         p = eol+1) {
+        eol = memchr(p, '\n', start + body_off - p);
+        n = eol+1 - p;
+        if (*p == '\r' || *p == '\n' || http_line_is(p, eol, "Content-Length")) {
+            continue;
+        }
+        if (rr->hdr_len + n + tail_len > sizeof(rr->hdr)) {
+            return RANGE_NONE;
+        }
+        memcpy(rr->hdr + rr->hdr_len, p, n);
+        rr->hdr_len += n;
+    }
+    memcpy(rr->hdr + rr->hdr_len, tail, tail_len);
+    rr->hdr_len += tail_len;
+    rr->from = body_off + first;
+    rr->to = body_off + last + 1;
+    return RANGE_OK;
+}
@@ -0,0 +1,27 @@
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include "csapp.h"
+#include "httpparse.h"
+
+/* what range_reply makes of a request */
+#define RANGE_WAIT (-1)     /* the response header block is not all in */
+#define RANGE_NONE 0        /* send the response whole, as it is */
+#define RANGE_OK 1          /* send the reply below instead */
+
+/* the answer to a ranged request for a 200 response: a 206 (or 416)
+ header block, then the bytes of the response from `from` up to `to` */
+struct range_reply{
+    char hdr[MAXBUF];
+    size_t hdr_len;
+    size_t from;
+    size_t to;
+    size_t total;           /* length of the whole 200 response */
+};
+
+/* Function prototypes */
+int range_asked(char *buf, struct http_request *req);
+int range_reply(char *buf, struct http_request *req, unsigned char *resp,
+                size_t len, int complete, struct range_reply *rr);
+
+#endif /* __RANGE_H__ */
@@ -0,0 +1,310 @@
+#include "slab.h"
+
+/* chunks start this far into a page */
+#define PAGE_HDR ((sizeof(struct slab_page)+SLAB_ALIGN-1) & ~(size_t)(SLAB_ALIGN-1))
+
+/* round n up to a multiple of a, a power of 2 */
+static size_t round_up(size_t n, size_t a)
+{
+    return (n + a - 1) & ~(a - 1);
+}
+
+/* set up the size classes, each about SLAB_GROWTH times the last */
+void slab_init(struct slab *sl)
+{
+    size_t size = SLAB_MIN_CHUNK;
+    int i = 0;
+
+    memset(sl, 0, sizeof(*sl));
+    while (i < SLAB_CLASSES-1 && size < SLAB_MAX_CHUNK) {
+        sl->cls[i].size = size;
+        i++;
+        size = round_up((size_t)(size*SLAB_GROWTH), SLAB_ALIGN);
+    }
+    sl->cls[i].size = SLAB_MAX_CHUNK;
+    sl->nclasses = i+1;
+    for (i = 0; i < sl->nclasses; i++) {
+        sl->cls[i].per_page = (SLAB_PAGE_SIZE - PAGE_HDR)/sl->cls[i].size;
+        Sem_init(&sl->cls[i].mutex, 0, 1);
+    }
+    Sem_init(&sl->large.mutex, 0, 1);
+}
+
+/* smallest class holding n bytes, or -1 if n needs a large chunk */
+static int class_of(struct slab *sl, size_t n)
+{
+    int lo = 0, hi = sl->nclasses-1;
+
+    if (n > sl->cls[hi].size) {
+        return -1;
+    }
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (sl->cls[mid].size >= n) {
+            hi = mid;
+        }
+        else {
+            lo = mid+1;
+        }
+    }
+    return lo;
+}
+
+/* map len bytes aligned to SLAB_PAGE_SIZE, trimming the slack */
+static struct slab_page *map_page(size_t len)
+{
+    size_t span = len + SLAB_PAGE_SIZE;
+    char *raw = (char *)Mmap(NULL, span, PROT_READ|PROT_WRITE,
+                             MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    char *start = (char *)round_up((size_t)raw, SLAB_PAGE_SIZE);
+
+    if (start > raw) {
+        Munmap(raw, start-raw);
+    }
+    if (raw+span > start+len) {
+        Munmap(start+len, raw+span-(start+len));
+    }
+    return (struct slab_page *)start;
+}
+
+/* page owning a chunk */
+static struct slab_page *page_of(void *p)
+{
+    return (struct slab_page *)((size_t)p & ~(size_t)(SLAB_PAGE_SIZE-1));
+}
+
+static void partial_remove(struct slab_class *c, struct slab_page *pg)
+{
+    if (pg->prev) {
+        pg->prev->next = pg->next;
+    }
+    else {
+        c->partial = pg->next;
+    }
+    if (pg->next) {
+        pg->next->prev = pg->prev;
+    }
+    pg->prev = NULL;
+    pg->next = NULL;
+}
+
+static void partial_push(struct slab_class *c, struct slab_page *pg)
+{
+    pg->prev = NULL;
+    pg->next = c->partial;
+    if (c->partial) {
+        c->partial->prev = pg;
+    }
+    c->partial = pg;
+}
+
+/* size of the chunk that slab_alloc(sl, n) would return.
+ the cache charges this, so fragmentation counts against its budget */
+size_t slab_chunk_size(struct slab *sl, size_t n)
+{
+    int ci = class_of(sl, n);
+
+    if (ci < 0) {
+        return round_up(PAGE_HDR + n, getpagesize()) - PAGE_HDR;
+    }
+    return sl->cls[ci].size;
+}
+
+/* a large chunk of len bytes, mapped, from the free lists if one of
+ that length was kept */
+static void *large_alloc(struct slab_large *lg, size_t len, size_t n)
+{
+    size_t slot = len / getpagesize();
+    struct slab_page *pg = NULL;
+
+    P(&lg->mutex);
+    if (slot < SLAB_LARGE_SLOTS && (pg = lg->free[slot]) != NULL) {
+        lg->free[slot] = pg->next;
+        lg->kept -= len;
+    }
+    else {
+        lg->st.mapped += len;
+    }
+    lg->st.chunks += len - PAGE_HDR;
+    lg->st.requested += n;
+    lg->st.large++;
+    V(&lg->mutex);
+
+    if (pg == NULL) {
+        pg = map_page(len);
+        pg->cls = -1;
+        pg->used = pg->carved = 1;
+        pg->free = NULL;
+        pg->map_len = len;
+    }
+    pg->prev = pg->next = NULL;
+    return (char *)pg + PAGE_HDR;
+}
+
+/* give back a large chunk of n requested bytes: keep it for reuse,
+ or unmap it if enough are kept already */
+static void large_free(struct slab_large *lg, struct slab_page *pg, size_t n)
+{
+    size_t slot = pg->map_len / getpagesize();
+
+    P(&lg->mutex);
+    lg->st.chunks -= pg->map_len - PAGE_HDR;
+    lg->st.requested -= n;
+    lg->st.large--;
+    if (slot < SLAB_LARGE_SLOTS && lg->kept + pg->map_len <= SLAB_LARGE_KEEP) {
+        pg->next = lg->free[slot];
+        lg->free[slot] = pg;
+        lg->kept += pg->map_len;
+        V(&lg->mutex);
+        return;
+    }
+    lg->st.mapped -= pg->map_len;
+    V(&lg->mutex);
+    Munmap(pg, pg->map_len);
+}
+
+/* allocate n bytes. chunks of a class are carved from shared pages,
+ anything bigger than the largest class gets a mapping of its own */
+void *slab_alloc(struct slab *sl, size_t n)
+{
+    int ci = class_of(sl, n);
+    struct slab_page *pg;
+    struct slab_class *c;
+    void *p;
+
+    if (ci < 0) {
+        return large_alloc(&sl->large, round_up(PAGE_HDR + n, getpagesize()),
+                           n);
+    }
+
+    c = &sl->cls[ci];
+    P(&c->mutex);
+    if ((pg = c->partial) == NULL) {
+        pg = map_page(SLAB_PAGE_SIZE);
+        pg->cls = ci;
+        pg->used = pg->carved = 0;
+        pg->free = NULL;
+        pg->map_len = SLAB_PAGE_SIZE;
+        partial_push(c, pg);
+        c->st.mapped += SLAB_PAGE_SIZE;
+        c->st.pages++;
+    }
+
+    /* reuse a freed chunk first, then carve a fresh one */
+    if (pg->free) {
+        p = pg->free;
+        pg->free = *(void **)p;
+    }
+    else {
+        p = (char *)pg + PAGE_HDR + pg->carved*c->size;
+        pg->carved++;
+    }
+    pg->used++;
+    if (pg->used == c->per_page) {
+        partial_remove(c, pg);
+    }
+    c->st.chunks += c->size;
+    c->st.requested += n;
+    V(&c->mutex);
+    return p;
+}
+
+/* give back a chunk of n requested bytes. a page with no chunks left
+ in use is unmapped unless it is the only room left in its class,
+ so the footprint follows the cache down as well as up */
+void slab_free(struct slab *sl, void *p, size_t n)
+{
+    struct slab_page *pg = page_of(p);
+    struct slab_class *c;
+
+    if (pg->cls < 0) {
+        large_free(&sl->large, pg, n);
+        return;
+    }
+
+    c = &sl->cls[pg->cls];
+    P(&c->mutex);
+    if (pg->used == c->per_page) {
+        partial_push(c, pg);
+    }
+    *(void **)p = pg->free;
+    pg->free = p;
+    pg->used--;
+    c->st.chunks -= c->size;
+    c->st.requested -= n;
+
+    if (pg->used == 0 && (pg->prev || pg->next)) {
+        partial_remove(c, pg);
+        c->st.mapped -= SLAB_PAGE_SIZE;
+        c->st.pages--;
+        V(&c->mutex);
+        Munmap(pg, SLAB_PAGE_SIZE);
+        return;
+    }
+    V(&c->mutex);
+}
+
+/* unmap the pages and kept large chunks left over once every chunk
+ has been freed */
+void slab_destroy(struct slab *sl)
+{
+    struct slab_page *pg;
+    int i;
+
+    for (i=0; i<sl->nclasses; i++) {
+        while ((pg = sl->cls[i].partial)) {
+            partial_remove(&sl->cls[i], pg);
+            Munmap(pg, SLAB_PAGE_SIZE);
+        }
+        memset(&sl->cls[i].st, 0, sizeof(sl->cls[i].st));
+    }
+    for (i=0; i<SLAB_LARGE_SLOTS; i++) {
+        while ((pg = sl->large.free[i])) {
+            sl->large.free[i] = pg->next;
+            Munmap(pg, pg->map_len);
+        }
+    }
+    sl->large.kept = 0;
+    memset(&sl->large.st, 0, sizeof(sl->large.st));
+}
+
+static void add_stats(struct slab_stats *st, struct slab_stats *s)
+{
+    st->mapped += s->mapped;
+    st->chunks += s->chunks;
+    st->requested += s->requested;
+    st->pages += s->pages;
+    st->large += s->large;
+}
+
+/* add up the counters of every class and the large chunks */
+void slab_get_stats(struct slab *sl, struct slab_stats *st)
+{
+    int i;
+
+    memset(st, 0, sizeof(*st));
+    for (i=0; i<sl->nclasses; i++) {
+        P(&sl->cls[i].mutex);
+        add_stats(st, &sl->cls[i].st);
+        V(&sl->cls[i].mutex);
+    }
+    P(&sl->large.mutex);
+    add_stats(st, &sl->large.st);
+    V(&sl->large.mutex);
+}
+
+/* resident set size of the whole process, 0 if it can not be read */
+size_t process_rss()
+{
+    unsigned long size, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+
+    if (fp == NULL) {
+        return 0;
+    }
+    if (fscanf(fp, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(fp);
+    return (size_t)resident * getpagesize();
+}
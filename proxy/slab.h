@@ -0,0 +1,76 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "csapp.h"
+
+/* Slab geometry */
+#define SLAB_PAGE_SIZE 16384        /* bytes per slab page, a power of 2 */
+#define SLAB_MIN_CHUNK 64           /* smallest size class */
+#define SLAB_MAX_CHUNK (SLAB_PAGE_SIZE/4)   /* largest class */
+#define SLAB_GROWTH 1.25            /* ratio between neighbouring classes */
+#define SLAB_ALIGN 16
+#define SLAB_CLASSES 64
+#define SLAB_LARGE_SLOTS 64         /* freed large chunks kept by length in
+                                       pages, up to this many pages */
+#define SLAB_LARGE_KEEP (1<<18)     /* bytes of freed large chunks kept */
+
+/* a page carved into equal chunks of one size class, or a single
+ large chunk. it sits at the start of its SLAB_PAGE_SIZE aligned
+ mapping, so a chunk finds its page by rounding its address down */
+struct slab_page{
+    struct slab_page *prev;
+    struct slab_page *next;
+    int cls;                        /* size class, -1 for a large chunk */
+    int used;                       /* chunks handed out */
+    int carved;                     /* chunks ever carved from the page */
+    void *free;                     /* freed chunks, linked through */
+    size_t map_len;                 /* length of the mapping */
+};
+
+/* memory counters, all in bytes */
+struct slab_stats{
+    size_t mapped;                  /* pages and large chunks mapped */
+    size_t chunks;                  /* chunk bytes handed out */
+    size_t requested;               /* bytes asked for in those chunks */
+    size_t pages;                   /* slab pages mapped */
+    size_t large;                   /* large chunks mapped */
+};
+
+/* one size class, with its own lock. pages with free room are kept
+ on partial; full pages are only reachable through their chunks */
+struct slab_class{
+    sem_t mutex;
+    size_t size;
+    int per_page;
+    struct slab_page *partial;
+    struct slab_stats st;           /* what this class holds */
+};
+
+/* chunks too big for any class, each a mapping of its own. freed
+ ones stay mapped on free, by length in pages, for the next chunk of
+ that length, while they add up to less than SLAB_LARGE_KEEP bytes */
+struct slab_large{
+    sem_t mutex;
+    struct slab_page *free[SLAB_LARGE_SLOTS];
+    size_t kept;                    /* bytes on the free lists */
+    struct slab_stats st;
+};
+
+/* an allocator. every class and the large chunks are locked on their
+ own, so it may be shared by every cache shard */
+struct slab{
+    struct slab_class cls[SLAB_CLASSES];
+    int nclasses;
+    struct slab_large large;
+};
+
+/* Function prototypes */
+void slab_init(struct slab *sl);
+void slab_destroy(struct slab *sl);
+void *slab_alloc(struct slab *sl, size_t n);
+void slab_free(struct slab *sl, void *p, size_t n);
+size_t slab_chunk_size(struct slab *sl, size_t n);
+void slab_get_stats(struct slab *sl, struct slab_stats *st);
+size_t process_rss();
+
+#endif /* __SLAB_H__ */
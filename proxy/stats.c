@@ -0,0 +1,206 @@
+/*
+   request statistics for the admin path STATS_PATH.
+
+   threads count into one of STATS_SLOTS fixed blocks, handed out in
+   turn on a thread's first count and found through a thread-local
+   pointer. the worker pool and the event loops have fewer threads
+   than slots, so each of them gets a block to itself; the threads
+   of the thread-per-connection mode share them. starting or ending
+   a thread takes no lock and allocates nothing, and recording is a
+   few atomic adds. readers add up every slot.
+
+   latencies go into log-linear histograms in the style of HDR
+   histograms: exact below HIST_SUB microseconds, then HIST_SUB
+   buckets per power of two, which keeps percentiles within a few
+   percent over the whole range at a fixed size.
+ */
+
+#include "stats.h"
+#include "cache.h"
+
+/* Global variables */
+static struct stats slots[STATS_SLOTS];
+static unsigned int next_slot=0;
+static __thread struct stats *mine=NULL;
+
+static char *stage_names[STAGES] = {
+    "accept", "parse", "lookup", "connect", "ttfb", "total"
+};
+static char *counter_names[STAT_COUNTERS] = {
+    "connections", "requests", "hits", "l2_hits", "misses",
+    "revalidated", "errors", "bytes_hit", "bytes_relayed"
+};
+
+/* add one slot's statistics to a total */
+static void add_stats(struct stats *to, struct stats *from)
+{
+    int i, j;
+
+    for (i = 0; i < STAT_COUNTERS; i++) {
+        to->counter[i] += from->counter[i];
+    }
+    for (i = 0; i < STAGES; i++) {
+        struct stat_hist *t = &to->hist[i], *f = &from->hist[i];
+        t->count += f->count;
+        t->sum += f->sum;
+        if (f->max > t->max) {
+            t->max = f->max;
+        }
+        for (j = 0; j < HIST_BUCKETS; j++) {
+            t->bucket[j] += f->bucket[j];
+        }
+    }
+}
+
+/* the calling thread's block, picked on first use */
+static struct stats *my_stats()
+{
+    if (mine == NULL) {
+        mine = &slots[__sync_fetch_and_add(&next_slot, 1) % STATS_SLOTS];
+    }
+    return mine;
+}
+
+void init_stats()
+{
+    memset(slots, 0, sizeof(slots));
+}
+
+/* a monotonic clock in microseconds */
+long stats_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000L + ts.tv_nsec/1000;
+}
+
+/* bucket of a value: exact below HIST_SUB, then the top
+ HIST_SUB_BITS bits after the leading one pick the bucket within
+ its power of two */
+static int hist_bucket(unsigned long v)
+{
+    int b;
+
+    if (v < HIST_SUB) {
+        return v;
+    }
+    if (v >= 1UL << HIST_MAX_BITS) {
+        v = (1UL << HIST_MAX_BITS) - 1;
+    }
+    b = 63 - __builtin_clzl(v);
+    return (b - HIST_SUB_BITS + 1)*HIST_SUB +
+    (int)((v >> (b - HIST_SUB_BITS)) - HIST_SUB);
+}
+
+/* largest value a bucket holds */
+static unsigned long hist_value(int i)
+{
+    int b;
+
+    if (i < HIST_SUB) {
+        return i;
+    }
+    b = i/HIST_SUB + HIST_SUB_BITS - 1;
+    return ((unsigned long)(HIST_SUB + i%HIST_SUB + 1) <<
+            (b - HIST_SUB_BITS)) - 1;
+}
+
+/* count an event n times */
+void stats_count(int counter, unsigned long n)
+{
+    __sync_fetch_and_add(&my_stats()->counter[counter], n);
+}
+
+/* record the time a stage took since start, a stats_now() value */
+void stats_time(int stage, long start)
+{
+    struct stat_hist *h = &my_stats()->hist[stage];
+    long v = stats_now() - start;
+    unsigned long max;
+
+    if (v < 0) {
+        v = 0;
+    }
+    __sync_fetch_and_add(&h->count, 1);
+    __sync_fetch_and_add(&h->sum, v);
+    while ((unsigned long)v > (max = h->max) &&
+           !__sync_bool_compare_and_swap(&h->max, max, v)) {
+    }
+    __sync_fetch_and_add(&h->bucket[hist_bucket(v)], 1);
+}
+
+/* add up every slot's statistics so far. threads keep counting
+ meanwhile, so the sums are a close snapshot, not an exact one */
+void stats_collect(struct stats *total)
+{
+    int i;
+
+    memset(total, 0, sizeof(*total));
+    for (i = 0; i < STATS_SLOTS; i++) {
+        add_stats(total, &slots[i]);
+    }
+}
+
+/* the value below which a fraction q of a histogram lies */
+static unsigned long hist_quantile(struct stat_hist *h, double q)
+{
+    unsigned long want = (unsigned long)(q*h->count + 0.5), seen = 0;
+    int i;
+
+    if (want == 0) {
+        want = 1;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= want) {
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* write the statistics as text into buf. returns the length */
+size_t stats_format(char *buf, size_t size)
+{
+    struct stats *total;
+    struct cache_stats cs;
+    size_t len = 0;
+    int i;
+
+    total = (struct stats *)Malloc(sizeof(struct stats));
+    stats_collect(total);
+    cache_get_stats(&cs);
+
+#define OUT(...) do { \
+        if (len < size) { \
+            len += snprintf(buf+len, size-len, __VA_ARGS__); \
+        } \
+    } while (0)
+
+    for (i = 0; i < STAT_COUNTERS; i++) {
+        OUT("%s %lu\n", counter_names[i], total->counter[i]);
+    }
+    OUT("cache_elements %zu\ncache_evictions %zu\n"
+        "cache_charged_bytes %zu\ncache_capacity_bytes %zu\n"
+        "rss_bytes %zu\n",
+        cs.elems, cs.evictions, cs.charged, cs.capacity, cs.rss);
+    OUT("\n%-8s %10s %10s %10s %10s %10s %10s %10s\n", "stage_us",
+        "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (i = 0; i < STAGES; i++) {
+        struct stat_hist *h = &total->hist[i];
+        if (h->count == 0) {
+            OUT("%-8s %10d %10d %10d %10d %10d %10d %10d\n",
+                stage_names[i], 0, 0, 0, 0, 0, 0, 0);
+            continue;
+        }
+        OUT("%-8s %10lu %10lu %10lu %10lu %10lu %10lu %10lu\n",
+            stage_names[i], h->count, h->sum/h->count,
+            hist_quantile(h, 0.5), hist_quantile(h, 0.9),
+            hist_quantile(h, 0.99), hist_quantile(h, 0.999), h->max);
+    }
+#undef OUT
+
+    Free(total);
+    return len < size ? len : size-1;
+}
@@ -0,0 +1,67 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+
+/* Admin path the proxy answers itself with its statistics */
+#define STATS_PATH "/__proxy/stats"
+
+/* Latency histograms: values in microseconds, HIST_SUB buckets per
+ power of two, so a bucket is within 1/HIST_SUB of what it holds */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36            /* about 19 hours */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* blocks of statistics threads count into */
+#define STATS_SLOTS 16
+
+/* stages of a request that are timed */
+enum stat_stage {
+    STAGE_ACCEPT,               /* accepted until a thread serves it */
+    STAGE_PARSE,                /* first request byte until parsed */
+    STAGE_LOOKUP,               /* cache lookup, both tiers */
+    STAGE_CONNECT,              /* name lookup and connect upstream */
+    STAGE_TTFB,                 /* request sent until response starts */
+    STAGE_TOTAL,                /* parsed until the response is sent */
+    STAGES
+};
+
+/* event counters */
+enum stat_counter {
+    STAT_CONNS,                 /* client connections accepted */
+    STAT_REQUESTS,              /* requests parsed */
+    STAT_HITS,                  /* served from memory */
+    STAT_L2_HITS,               /* served from the disk tier */
+    STAT_MISSES,                /* fetched from the web server */
+    STAT_REVALIDATED,           /* stale copies a 304 renewed */
+    STAT_ERRORS,                /* error replies and failed fetches */
+    STAT_BYTES_HIT,             /* bytes sent from the cache */
+    STAT_BYTES_RELAYED,         /* bytes relayed from web servers */
+    STAT_COUNTERS
+};
+
+/* a histogram of one stage */
+struct stat_hist{
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+    unsigned long bucket[HIST_BUCKETS];
+};
+
+/* one slot's statistics. the threads that share a slot record with
+ atomic adds, so no lock is taken; readers add up every slot */
+struct stats{
+    unsigned long counter[STAT_COUNTERS];
+    struct stat_hist hist[STAGES];
+};
+
+/* Function prototypes */
+void init_stats();
+long stats_now();
+void stats_count(int counter, unsigned long n);
+void stats_time(int stage, long start);
+void stats_collect(struct stats *total);
+size_t stats_format(char *buf, size_t size);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,78 @@
+/*
+   queues of tokens handed back to an event loop.
+
+   name lookups and flights finish on other threads and have to
+   tell the loop which of its connections can carry on. the tokens
+   are kept in a locked list and an eventfd is bumped to wake the
+   loop. the eventfd is non-blocking and its counter cannot fill up,
+   so a post never blocks, even from the loop's own thread.
+ */
+
+#include <sys/eventfd.h>
+#include "wake.h"
+
+/* make an empty queue */
+void wake_init(struct wake_queue *q)
+{
+    if ((q->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        unix_error("eventfd error");
+    }
+    Sem_init(&q->mutex, 0, 1);
+    q->head = q->tail = NULL;
+}
+
+/* add a token to the tail of the queue and wake the loop */
+void wake_post(struct wake_queue *q, void *token)
+{
+    struct wake_item *w = (struct wake_item *)Malloc(sizeof(struct wake_item));
+    uint64_t one = 1;
+
+    w->token = token;
+    w->next = NULL;
+    P(&q->mutex);
+    if (q->tail) {
+        q->tail->next = w;
+    }
+    else {
+        q->head = w;
+    }
+    q->tail = w;
+    V(&q->mutex);
+
+    if (write(q->fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        unix_error("wake write error");
+    }
+}
+
+/* reset the eventfd before taking tokens, so that a post made
+ while they are taken wakes the loop again */
+void wake_clear(struct wake_queue *q)
+{
+    uint64_t n;
+
+    if (read(q->fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+        unix_error("wake read error");
+    }
+}
+
+/* take the token at the head of the queue, or NULL if it is empty */
+void *wake_take(struct wake_queue *q)
+{
+    struct wake_item *w;
+    void *token;
+
+    P(&q->mutex);
+    if ((w = q->head) == NULL) {
+        V(&q->mutex);
+        return NULL;
+    }
+    q->head = w->next;
+    if (q->head == NULL) {
+        q->tail = NULL;
+    }
+    V(&q->mutex);
+
+    token = w->token;
+    Free(w);
+    return token;
+}
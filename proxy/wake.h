@@ -0,0 +1,27 @@
+#ifndef __WAKE_H__
+#define __WAKE_H__
+
+#include "csapp.h"
+
+/* a token handed back to an event loop */
+struct wake_item{
+    void *token;
+    struct wake_item *next;
+};
+
+/* tokens other threads hand back to one event loop. they wait in
+ the list; the eventfd, which the loop watches, only says the list
+ may not be empty, so posting never blocks however many pile up */
+struct wake_queue{
+    sem_t mutex;
+    int fd;
+    struct wake_item *head, *tail;
+};
+
+/* Function prototypes */
+void wake_init(struct wake_queue *q);
+void wake_post(struct wake_queue *q, void *token);
+void wake_clear(struct wake_queue *q);
+void *wake_take(struct wake_queue *q);
+
+#endif /* __WAKE_H__ */
@@ -0,0 +1,86 @@
+/*
+   zero-copy body forwarding with splice(2).
+
+   bytes move from the server socket into a pipe and from the pipe to
+   the client socket without ever being copied into user space. this
+   is used for bodies the proxy is not going to cache.
+
+   splice needs _GNU_SOURCE, whose netdb.h declarations clash with
+   csapp.h, so this file stands on its own.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* Largest block moved per splice call */
+#define SPLICE_BLOCK 65536
+
+/* drain n bytes sitting in the pipe to out */
+static int drain_pipe(int pipefd, int out, ssize_t n)
+{
+    ssize_t m;
+
+    while (n > 0) {
+        m = splice(pipefd, NULL, out, NULL, n, SPLICE_F_MOVE|SPLICE_F_MORE);
+        if (m < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        n -= m;
+    }
+    return 0;
+}
+
+/* move len bytes, or everything up to EOF if len is -1, from socket
+ in to socket out. returns the number of bytes moved, which is less
+ than len if in hit EOF early. returns -1 on error, and -2 if the
+ kernel cannot splice these descriptors before any byte was moved,
+ in which case the caller should copy instead */
+long splice_relay(int in, int out, long len)
+{
+    int p[2];
+    long total = 0;
+    size_t want;
+    ssize_t n;
+
+    if (pipe(p) < 0) {
+        return -2;
+    }
+    while (len != 0) {
+        want = SPLICE_BLOCK;
+        if (len > 0 && len < SPLICE_BLOCK) {
+            want = len;
+        }
+        n = splice(in, NULL, p[1], NULL, want, SPLICE_F_MOVE|SPLICE_F_MORE);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                total = -2;
+            }
+            else {
+                total = -1;
+            }
+            break;
+        }
+        if (n == 0) {
+            break;      /* EOF */
+        }
+        if (drain_pipe(p[0], out, n) < 0) {
+            total = -1;
+            break;
+        }
+        total += n;
+        if (len > 0) {
+            len -= n;
+        }
+    }
+    close(p[0]);
+    close(p[1]);
+    return total;
+}